@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dns.h"
+#include "storage.h"
+
+//Lookups timed at each fan-out.
+#define LOOKUPS 1000000
+
+/**
+ Returns the time in ns on a clock that only goes forward.
+*/
+uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ Writes the wire format name of child i of the domain for a fan-out into name.
+*/
+void child_name(int fanout, int i, char *name){
+	char text[64];
+	snprintf(text, sizeof(text), "host%d.f%d.bench", i, fanout);
+	string_to_domainname(text, name);
+}
+
+/**
+ Times insert_record and find_domain with more and more subdomains under one domain.
+ Every fan-out gets a domain of its own, so the cache isnt set up again between them.
+*/
+int main(int argc, char **argv){
+	int fanouts[] = {10, 100, 1000, 10000, 100000};
+	if(init_cache() < 0){
+		printf("failed to set up the cache\n");
+		return -1;
+	}
+	srand(1);
+
+	printf("%8s %14s %14s\n", "fanout", "insert (ns)", "lookup (ns)");
+	for(int f = 0; f < sizeof(fanouts) / sizeof(fanouts[0]); f++){
+		int fanout = fanouts[f];
+		char name[255];
+		uint32_t address = 0x0100007f;
+		dns_resource_record_t rr = {name, T_A, C_IN, 3600, 4, &address};
+
+		uint64_t start = now_ns();
+		for(int i = 0; i < fanout; i++){
+			child_name(fanout, i, name);
+			if(insert_record(&rr) < 0){
+				printf("failed to insert %d of %d\n", i, fanout);
+				return -1;
+			}
+		}
+		uint64_t insert_time = (now_ns() - start) / fanout;
+
+		// names are made up front so only the lookups are timed.
+		int name_no = fanout < 1024 ? fanout : 1024;
+		char (*names)[255] = malloc(name_no * 255);
+		for(int i = 0; i < name_no; i++){
+			child_name(fanout, rand() % fanout, names[i]);
+		}
+		int found = 0;
+		start = now_ns();
+		for(int i = 0; i < LOOKUPS; i++){
+			found += find_domain(names[i % name_no]) != NULL;
+		}
+		uint64_t lookup_time = (now_ns() - start) / LOOKUPS;
+		free(names);
+		if(found != LOOKUPS){
+			printf("only found %d of %d\n", found, LOOKUPS);
+			return -1;
+		}
+		printf("%8d %14lu %14lu\n", fanout, (unsigned long)insert_time, (unsigned long)lookup_time);
+	}
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
 #include <arpa/inet.h>
 
 #include <unistd.h>
@@ -11,18 +12,71 @@
 #include <netdb.h>
 #include "dns.h"
 
-char *domainname_ptr_to_string(void *packet_start, int ptr);
-int domainname_to_string(void *packet_start, int offset, char *output);
-char *characterstring_to_cstring(void *string);
+// Most compression pointers we will follow in one name.
+#define MAX_POINTER_HOPS 127
+// Lower cases an ASCII letter, names compare without case but only for letters.
+#define FOLD_CASE(c) ((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c))
+
+void arena_shrink(dns_arena_t *arena, void *last, size_t size);
+int parse_name(void *packet_start, int offset, int n, dns_arena_t *arena, char **name);
+dns_resource_record_t **parse_section(void *data, int n, int *read_bytes, int count, dns_arena_t *arena);
+int rdata_names(uint16_t type, int *prefix, int *suffix);
+int expand_rdata(void *packet_start, int offset, int end, dns_arena_t *arena, dns_resource_record_t *rr);
+bool name_at(dns_encoder_t *encoder, int offset, char *name);
+int encode_name(dns_encoder_t *encoder, char *name);
+int write_resource_record(void *packet_start, int offset, int n, dns_resource_record_t *rr);
+
+/**
+ Sets up an arena over the size bytes at buf.
+*/
+void arena_init(dns_arena_t *arena, void *buf, size_t size){
+	arena->base = buf;
+	arena->size = size;
+	arena->used = 0;
+}
+
+/**
+ Takes size bytes (8 byte aligned) from the arena.
+ returns NULL if the arena is out of room.
+*/
+void *arena_alloc(dns_arena_t *arena, size_t size){
+	size_t start = (arena->used + 7) & ~(size_t)7;
+	if(start + size > arena->size){
+		return NULL;
+	}
+	arena->used = start + size;
+	return arena->base + start;
+}
+
+/**
+ Gives back the end of the last allocation made from the arena, keeping the first size bytes.
+*/
+void arena_shrink(dns_arena_t *arena, void *last, size_t size){
+	arena->used = ((char *)last - arena->base) + size;
+}
+
+/**
+ Releases everything allocated from the arena at once.
+*/
+void arena_reset(dns_arena_t *arena){
+	arena->used = 0;
+}
 
 /**
 Parses the data from a packet that is n bytes long
+Everything the packet needs is allocated from the arena, names and RData point into data where they can.
+So the packet is only good until the arena is reset or data is reused.
+
+returns NULL if the packet is malformed or the arena runs out.
 */
-dns_packet_t *parse_packet(void *data, int n){
+dns_packet_t *parse_packet(void *data, int n, dns_arena_t *arena){
 	if(n < 12){ // Header is 12 bytes minimum
 		return NULL;
 	}
-	dns_packet_t *packet = malloc(sizeof(dns_packet_t));
+	dns_packet_t *packet = arena_alloc(arena, sizeof(dns_packet_t));
+	if(packet == NULL){
+		return NULL;
+	}
 
 	packet->header.QID = ntohs(((uint16_t *)data)[0]);
 	//TODO short circuit if not valid
@@ -42,200 +96,227 @@ dns_packet_t *parse_packet(void *data, int n){
 	packet->header.NSCount = ntohs(((uint16_t *)data)[4]);
 	packet->header.ARCount = ntohs(((uint16_t *)data)[5]);
 	
-	packet->questions = malloc(packet->header.QDCount * sizeof(dns_question_t));
+	packet->questions = arena_alloc(arena, packet->header.QDCount * sizeof(dns_question_t *));
+	dns_question_t *questions = arena_alloc(arena, packet->header.QDCount * sizeof(dns_question_t));
+	if(packet->questions == NULL || questions == NULL){
+		return NULL;
+	}
 
 	int read_bytes = 12;
 	for(int i = 0; i < packet->header.QDCount; i ++){
-		dns_question_t *question = malloc(sizeof(dns_question_t));
-		read_bytes += parse_question(data, read_bytes, question);//TODO check return
-		packet->questions[i] = question;
+		int length = parse_question(data, read_bytes, n, arena, &questions[i]);
+		if(length < 0){
+			return NULL;
+		}
+		read_bytes += length;
+		packet->questions[i] = &questions[i];
 	}
 
-	packet->answers = malloc(packet->header.ANCount * sizeof(dns_resource_record_t));
-
-	for(int i = 0; i < packet->header.ANCount; i ++){
-		dns_resource_record_t *answer = malloc(sizeof(dns_resource_record_t));
-		read_bytes += parse_resource_record(data, read_bytes, answer);//TODO check return
-		packet->answers[i] = answer;
+	packet->answers = parse_section(data, n, &read_bytes, packet->header.ANCount, arena);
+	if(packet->answers == NULL){
+		return NULL;
 	}
-
-	packet->authorities = malloc(packet->header.NSCount * sizeof(dns_resource_record_t));
-
-	for(int i = 0; i < packet->header.NSCount; i ++){
-		dns_resource_record_t *authority = malloc(sizeof(dns_resource_record_t));
-		read_bytes += parse_resource_record(data, read_bytes, authority);//TODO check return
-		packet->authorities[i] = authority;
+	packet->authorities = parse_section(data, n, &read_bytes, packet->header.NSCount, arena);
+	if(packet->authorities == NULL){
+		return NULL;
+	}
+	packet->additional = parse_section(data, n, &read_bytes, packet->header.ARCount, arena);
+	if(packet->additional == NULL){
+		return NULL;
 	}
 
-	packet->additional = malloc(packet->header.ARCount * sizeof(dns_resource_record_t));
-
+	packet->opt = NULL;
 	for(int i = 0; i < packet->header.ARCount; i ++){
-		dns_resource_record_t *additional = malloc(sizeof(dns_resource_record_t));
-		read_bytes += parse_resource_record(data, read_bytes, additional);//TODO check return
-		packet->additional[i] = additional;
+		dns_resource_record_t *rr = packet->additional[i];
+		if(rr->Type != T_OPT){
+			continue;
+		}
+		// only one, owned by the root and written as a single 0, so remove_opt can find where it starts.
+		if(packet->opt != NULL || rr->Name != (char *)rr->RData - 11 || rr->Name[0] != 0){
+			return NULL;
+		}
+		packet->opt = rr;
 	}
 
 	return packet;
 }
 
 /**
- Converts a dns message character string to a cstring (null terminated)
- the returned pointer will be heap allocated and must be freed
- If there are any null characters in the dns string, the method returns null
- 
- The resulting string will be exactly the same length in total bytes,
- same number of characters and replace the length byte with the null byte
+ Parses count resource records starting at *read_bytes, and moves *read_bytes past them.
+ returns an array of the records, allocated from the arena, or NULL on failure.
 */
-char *characterstring_to_cstring(void *string){
-	short length = ((char *)string)[0]; // first byte is length.
-	
-	char *out = malloc((length+1) * sizeof(char));
-	strncpy(out, string+1, length);
-	out[length] = '\0';
-
-	// Make sure that there is no null character in the middle of the string that will mess us up
-	if(strlen(out) != length){
-		free(out);
+dns_resource_record_t **parse_section(void *data, int n, int *read_bytes, int count, dns_arena_t *arena){
+	dns_resource_record_t **section = arena_alloc(arena, count * sizeof(dns_resource_record_t *));
+	dns_resource_record_t *records = arena_alloc(arena, count * sizeof(dns_resource_record_t));
+	if(section == NULL || records == NULL){
 		return NULL;
 	}
-	return out;
+	for(int i = 0; i < count; i ++){
+		int length = parse_resource_record(data, *read_bytes, n, arena, &records[i]);
+		if(length < 0){
+			return NULL;
+		}
+		*read_bytes += length;
+		section[i] = &records[i];
+	}
+	return section;
 }
 
 /**
- Converts a domain-name (series of labels) into a string with . separated labels
-*/
-char *domainname_ptr_to_string(void *packet_start, int ptr){
-	void *name = packet_start+ptr;
+  reads a domain name out of a packet, into wire format with any compression removed.
+  That is length prefixed labels ending with the 0-length root label, at most 255 bytes.
+  packet_start should point to the start of the DNS packet (for Compression purposes), which is n bytes long
+  offset should be the number of bytes from packet_start to the start of the domain name
+  output should point to at least 255 bytes.
 
-	int offset = 0;
-	char *out = malloc(256 * sizeof(char)); //TODO I think this is maximal? including dots.
-	char *nextout = out;
+  Compression pointers are followed in the same loop. Each one has to point before where the labels it was
+  found in started (the name itself for the first), so every jump goes further back and a name cant loop,
+  even A to B and back to A. There can also be at most MAX_POINTER_HOPS of them.
+  Nothing outside the n bytes of the packet is read.
 
-	while(offset < 255){ // names can by 255 bytes or less
+  The method returns the number of bytes in this domain name in the packet (needs to be calculated since pointers mess up string length,
+  or -1 if the name is malformed.
+  */
+int read_domainname(void *packet_start, int offset, int n, char *output){
+	unsigned char *data = packet_start;
+	int pos = offset; // where we are reading, jumps around with pointers
+	int len = -1; // bytes of the name at offset, known once we reach the end or the first pointer
+	int written = 0; // bytes written to output
+	int hops = 0;
+	int run_start = offset; // where the labels being read started, the next pointer has to go before it.
+
+	while(pos < n){
+		unsigned char length = data[pos];
 		//check that we dont have a pointer
-		if(((char *)name)[offset] > 63){
-			uint16_t ptr = ntohs(((uint16_t*)(((char *)name + offset)))[0]) & 0x3FFF;
-				
-			char *labels = domainname_ptr_to_string(packet_start, ptr);
-			if(labels == NULL){
-				free(out);
-				return NULL; //todo figure out what error this should be
+		if((length & 0xC0) == 0xC0){
+			if(pos + 1 >= n || ++hops > MAX_POINTER_HOPS){
+				return -1;
 			}
-			strncpy(nextout, labels, strlen(labels)); //TODO make this bounds check
-			free(labels);
-
-			return out; // todo, have this check for pointers and not fail.
+			int ptr = ((length & 0x3F) << 8) | data[pos+1];
+			if(ptr >= run_start){
+				return -1; // only further back each time, or we could go round forever.
+			}
+			if(len < 0){
+				len = pos + 2 - offset;
+			}
+			pos = ptr;
+			run_start = ptr;
+			continue;
 		}
-		
-		char *label = characterstring_to_cstring(name+offset);
-		if(label == NULL){
-			free(out);
-			return NULL; // invalid null char in string.
+		if(length > 63 || pos + length + 1 > n || written + length + 1 > 255){
+			return -1; // extended label types, past the end of the packet, or too long.
 		}
-		int length = strlen(label);
-		if(length == 0){
-			free(label);
-			break; // 0-length label at the end
+
+		memcpy(output+written, data+pos, length+1);
+		written += length + 1;
+		pos += length + 1;
+
+		if(length == 0){ // 0-length label at the end
+			return len < 0 ? pos - offset : len;
 		}
+	}
+	return -1;
+}
 
-		//TODO add bounds checking, min length/remaining chars?
-		nextout = stpncpy(nextout, label, length);
-		nextout[0] = '.';
-		nextout++;
+/**
+ Points *name at the domain name at offset in a packet n bytes long.
+ A name with no compression is used in place, one with compression pointers is expanded straight into the arena.
 
-		offset += length+1; // skip to next string.
-		//TODO check if over 255 and return error?
-		free(label);
+ returns the number of bytes the name takes up in the packet, or -1 on failure.
+*/
+int parse_name(void *packet_start, int offset, int n, dns_arena_t *arena, char **name){
+	unsigned char *data = packet_start;
+	int len = 0;
+	while(offset+len < n && len < 255 && data[offset+len] != 0 && data[offset+len] <= 63){
+		len += data[offset+len] + 1;
+	}
+	if(offset+len < n && len < 255 && data[offset+len] == 0){
+		*name = packet_start + offset;
+		return len + 1;
 	}
-	nextout[0] = '\0'; //dont override last dot with NULL
-	return out;
 
-	//length of each label in dns is len +1 for length
-	//so total length is sum[len +1] plus the 1 for 0 length
-	//length in string is len +1 for the dot except the last one.
-	//so total length is sum[len +1] minus the last dot.
-	//so length of c string is length of data - 2
-	//size: data can be 255, cstring is 255-2 +1 == 254 max.
+	*name = arena_alloc(arena, 255);
+	if(*name == NULL){
+		return -1;
+	}
+	int read = read_domainname(packet_start, offset, n, *name);
+	if(read < 0){
+		return -1;
+	}
+	arena_shrink(arena, *name, domainname_length(*name));
+	return read;
 }
 
 /**
-  parses a domain name into a '.' separated cstring of labels.
-  packet_start should point to the start of the DNS packet (for Compression purposes)
-  offset should be the number of bytes from packet_start to the start of the domain name
-  output should point to a malloced 256 character string (TODO make sure thats the right length, TODO maybe have this allocate it and make output a double pointer?)
+ Returns the number of bytes in a wire format domain name (see read_domainname), including the root label.
+*/
+int domainname_length(char *name){
+	int len = 0;
+	while(name[len] != 0){
+		len += (unsigned char)name[len] + 1;
+	}
+	return len + 1;
+}
 
-  The method returns the number of bytes in this domain name (needs to be calculated since pointers mess up string length.
-  */
-int domainname_to_string(void *packet_start, int offset, char *output){
-	if(output == NULL){
-		return -1; // TODO crash
+/**
+ Converts a wire format domain name into a '.' separated cstring of labels, for printing.
+ output should point to at least 256 bytes.
+ The root domain is "", every other name ends with a '.'.
+*/
+void domainname_to_string(char *name, char *output){
+	while(*name != 0){
+		int length = (unsigned char)*name;
+		memcpy(output, name+1, length);
+		output[length] = '.';
+		output += length + 1;
+		name += length + 1;
 	}
+	*output = '\0';
+}
 
-	int len = 0;
-	//char *out = malloc(256 * sizeof(char)); //TODO I think this is maximal? including dots.
-	char *nextout = output;
+/**
+ Converts a '.' separated cstring of labels (as made by domainname_to_string) into a wire format domain-name.
+ output should point to at least 255 bytes.
 
-	while(len < 255){ // names can by 255 bytes or less
-		//check that we dont have a pointer
-		if(((char *)packet_start)[offset+len] > 63){
-			uint16_t ptr = ntohs(((uint16_t*)(((char *)packet_start + offset+len)))[0]) & 0x3FFF;
-				
-			char *labels = domainname_ptr_to_string(packet_start, ptr); //TODO this doesnt need to call out, could just change offset and continue. Would need to stop using len as an offset and jsut change offset every read.;
-			if(labels == NULL){
-				return -1; //todo figure out what error this should be
-			}
-			strncpy(nextout, labels, strlen(labels)); //TODO make this bounds check
-			free(labels);
-			len +=2;
-			
-			return len;
-		}
-		
-		char *label = characterstring_to_cstring(packet_start+offset+len);
-		if(label == NULL){
-			return -1; // invalid null char in string.
+ returns the number of bytes written, or -1 if the name is not valid.
+*/
+int string_to_domainname(char *name, char *output){
+	int len = 0;
+	while(*name != '\0'){
+		char *dot = strchr(name, '.');
+		int length = (dot == NULL) ? strlen(name) : dot - name;
+		if(length == 0 || length > 63 || len + length + 2 > 255){
+			return -1;
 		}
-		int length = strlen(label);
+		output[len] = length;
+		memcpy(output+len+1, name, length);
 		len += length + 1;
 
-		if(length == 0){
-			free(label);
-			break; // 0-length label at the end
+		name += length;
+		if(*name == '.'){
+			name++;
 		}
-
-		//TODO add bounds checking, min length/remaining chars?
-		nextout = stpncpy(nextout, label, length);
-		nextout[0] = '.';
-		nextout++;
-
-		//TODO check if over 255 and return error?
-		free(label);
 	}
-	nextout[0] = '\0'; //dont override last dot with NULL
-	return len;
-
-	//length of each label in dns is len +1 for length
-	//so total length is sum[len +1] plus the 1 for 0 length
-	//length in string is len +1 for the dot except the last one.
-	//so total length is sum[len +1] minus the last dot.
-	//so length of c string is length of data - 2
-	//size: data can be 255, cstring is 255-2 +1 == 254 max.
+	output[len] = '\0'; // 0-length label at the end
+	return len + 1;
 }
 
 /**
- parses out a DNS question that starts at data.
+ parses out a DNS question that starts at offset, in a packet n bytes long.
  The data is loaded into the question pointer passed in.
 
- returns the number of bytes read.
+ returns the number of bytes read, or -1 on failure.
 */
-int parse_question(void *packet_start, int offset, dns_question_t *question){
+int parse_question(void *packet_start, int offset, int n, dns_arena_t *arena, dns_question_t *question){
 	if(question == NULL){
 		return -1;//TODO failure mode
 	}
-	void *data = packet_start + offset;
 
-	int length = domainname_to_string(packet_start, offset, question->QName);
-//TODO Check return
+	int length = parse_name(packet_start, offset, n, arena, &question->QName);
+	if(length < 0 || offset + length + 4 > n){
+		return -1;
+	}
+	void *data = packet_start + offset;
 
 	question->QType = ntohs(((uint16_t *)(data + length))[0]);
 	question->QClass = ntohs(((uint16_t *)(data + length))[1]);
@@ -243,31 +324,498 @@ int parse_question(void *packet_start, int offset, dns_question_t *question){
 }
 
 /**
- parses out a DNS answer that starts at data.
- The data is loaded into the answer pointer passed in
- Answer data is malloced.
+ parses out a DNS resource record that starts at offset, in a packet n bytes long.
+ The data is loaded into the rr pointer passed in
+ RData points into the packet, unless it holds names that had to be expanded into the arena.
 
- returns the number of bytes read.
+ returns the number of bytes read, or -1 on failure.
 */
-int parse_resource_record(void *packet_start, int offset, dns_resource_record_t *rr){
+int parse_resource_record(void *packet_start, int offset, int n, dns_arena_t *arena, dns_resource_record_t *rr){
 	if(rr == NULL){
 		return -1; // TODO failure mode
 	}
 
+	int length = parse_name(packet_start, offset, n, arena, &rr->Name);
+	if(length < 0 || offset + length + 10 > n){
+		return -1;
+	}
 	void *data = packet_start+offset;
 
-	int length = domainname_to_string(packet_start, offset, rr->Name);
-//TODO Check return
 	rr->Type = ntohs(((uint16_t *)(data + length))[0]);
 	rr->Class = ntohs(((uint16_t *)(data + length))[1]);
 	rr->TTL = ntohl(((uint32_t *)(data + length))[1]);
 	rr->RDLength = ntohs(((uint16_t *)(data + length))[4]);
-	rr->RData = malloc(sizeof(char) * rr->RDLength);
-	//TODO check malloc
-	memcpy(rr->RData, data+length+10, rr->RDLength);
+	int rdlength = rr->RDLength;
+	if(offset + length + 10 + rdlength > n){
+		return -1;
+	}
+
+	// Names in the RData can point back into the packet, so they have to be expanded before the RData can stand on its own.
+	int expanded = expand_rdata(packet_start, offset+length+10, offset+length+10+rdlength, arena, rr);
+	if(expanded < 0){
+		return -1;
+	}
+	if(expanded == 0){
+		rr->RData = data+length+10;
+	}
+	return length + 10 + rdlength;
+}
+
+/**
+ Says where the domain names are in the RData of a type, they can be compressed so have to be handled apart from the rest.
+ *prefix is set to the bytes before the first name, *suffix to the bytes after the last.
+
+ returns the number of names, 0 for types that dont hold any.
+*/
+int rdata_names(uint16_t type, int *prefix, int *suffix){
+	*prefix = 0;
+	*suffix = 0;
+	switch(type){
+		case T_NS: case T_MD: case T_MF: case T_CNAME:
+		case T_MB: case T_MG: case T_MR: case T_PTR:
+			return 1;
+		case T_MX:
+			*prefix = 2;
+			return 1;
+		case T_MINFO:
+			return 2;
+		case T_SOA:
+			*suffix = 20;
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+/**
+ Returns the length of the wire format name at the start of length bytes, held to the same rules as read_domainname:
+ no label over 63 bytes and no more than 255 bytes in all. returns -1 if it breaks them or runs past length.
+*/
+int name_span(char *name, int length){
+	int i = 0;
+	while(i < length && name[i] != 0){
+		if((unsigned char)name[i] > 63){
+			return -1;
+		}
+		i += (unsigned char)name[i] + 1;
+	}
+	if(i >= length || i + 1 > 255){
+		return -1;
+	}
+	return i + 1;
+}
+
+/**
+ Checks that the names in RData of a type are whole and fill it with the bytes around them, see rdata_names.
+ For RData that didnt come from a packet, readers of the cache and zones follow the names without checking.
+*/
+bool rdata_valid(uint16_t type, char *rdata, int length){
+	int prefix;
+	int suffix;
+	int names = rdata_names(type, &prefix, &suffix);
+	if(names == 0){
+		return true;
+	}
+	int offset = prefix;
+	for(int i = 0; i < names; i++){
+		int span = name_span(rdata + offset, length - offset);
+		if(span < 0){
+			return false;
+		}
+		offset += span;
+	}
+	return offset + suffix == length;
+}
+
+/**
+ Expands any compressed domain names in the RData that runs from offset to end.
+ Only types whose RData holds domain names are expanded,
+ on success rr->RData is allocated from the arena and rr->RDLength updated to the expanded length.
+
+ returns the expanded length, 0 if the type has no names, or -1 if they could not be parsed.
+*/
+int expand_rdata(void *packet_start, int offset, int end, dns_arena_t *arena, dns_resource_record_t *rr){
+	int prefix; // bytes before the first name
+	int suffix; // bytes after the last name
+	int names = rdata_names(rr->Type, &prefix, &suffix);
+	if(names == 0){
+		return 0;
+	}
+	if(offset + prefix > end){
+		return -1;
+	}
+
+	char *out = arena_alloc(arena, prefix + names*255 + suffix);
+	if(out == NULL){
+		return -1;
+	}
+	int in = offset + prefix;
+	int len = prefix;
+	memcpy(out, packet_start+offset, prefix);
+	for(int i = 0; i < names; i ++){
+		int read = read_domainname(packet_start, in, end, out+len);
+		if(read < 0){
+			return -1;
+		}
+		in += read;
+		len += domainname_length(out+len);
+	}
+	if(in + suffix > end){
+		return -1;
+	}
+	memcpy(out+len, packet_start+in, suffix);
+	len += suffix;
+
+	arena_shrink(arena, out, len);
+	rr->RData = out;
+	rr->RDLength = len;
+	return len;
+}
+
+/**
+ Starts a message in buf, which is size bytes long, with the given header.
+ The counts in the header are ignored, they are kept as things are encoded.
+*/
+void encoder_init(dns_encoder_t *encoder, void *buf, int size, dns_header_t *header){
+	encoder->buf = buf;
+	encoder->size = size;
+	encoder->length = 12;
+	encoder->question_end = 12;
+	encoder->question_names = 0;
+	encoder->name_no = 0;
+	memset(encoder->counts, 0, sizeof(encoder->counts));
+
+	char *data = buf;
+	((uint16_t *)data)[0] = htons(header->QID);
+	data[2] = (header->QR << 7) | (header->OpCode << 3) | (header->AA << 2) | (header->TC << 1) | header->RD;
+	data[3] = (header->RA << 7) | (header->Z << 4) | header->RCode;
+}
+
+/**
+ Checks if the name written at offset in the message is name, ignoring case.
+ Pointers in the message are followed, they were all written by us so they lead somewhere sensible.
+*/
+bool name_at(dns_encoder_t *encoder, int offset, char *name){
+	unsigned char *data = (unsigned char *)encoder->buf;
+	while(1){
+		if((data[offset] & 0xC0) == 0xC0){
+			offset = ((data[offset] & 0x3F) << 8) | data[offset+1];
+			continue;
+		}
+		int length = data[offset];
+		if(length != (unsigned char)*name){
+			return false;
+		}
+		if(length == 0){
+			return true;
+		}
+		for(int i = 1; i <= length; i ++){
+			unsigned char a = data[offset+i], b = name[i];
+			if(a != b && FOLD_CASE(a) != FOLD_CASE(b)){
+				return false;
+			}
+		}
+		offset += length + 1;
+		name += length + 1;
+	}
+}
+
+/**
+ Writes a wire format name, pointing at the longest ending of it that is already in the message.
+ Every new ending written is remembered so later names can point at it.
+
+ returns the number of bytes written, or -1 if it doesnt fit.
+*/
+int encode_name(dns_encoder_t *encoder, char *name){
+	int start = encoder->length;
+	int name_no = encoder->name_no;
+	char *label = name;
+	while(*label != 0){
+		for(int i = 0; i < encoder->name_no; i ++){
+			if(name_at(encoder, encoder->names[i], label)){
+				if(encoder->length + 2 > encoder->size){
+					encoder->length = start;
+					encoder->name_no = name_no;
+					return -1;
+				}
+				encoder->buf[encoder->length] = 0xC0 | (encoder->names[i] >> 8);
+				encoder->buf[encoder->length+1] = encoder->names[i] & 0xFF;
+				encoder->length += 2;
+				return encoder->length - start;
+			}
+		}
+
+		int length = (unsigned char)*label + 1;
+		if(encoder->length + length > encoder->size){
+			encoder->length = start;
+			encoder->name_no = name_no;
+			return -1;
+		}
+		// pointers only have 14 bits, endings past that just cant be pointed at.
+		if(encoder->name_no < MAX_COMPRESSION && encoder->length < 0x4000){
+			encoder->names[encoder->name_no++] = encoder->length;
+		}
+		memcpy(encoder->buf + encoder->length, label, length);
+		encoder->length += length;
+		label += length;
+	}
+	if(encoder->length + 1 > encoder->size){
+		encoder->length = start;
+		encoder->name_no = name_no;
+		return -1;
+	}
+	encoder->buf[encoder->length++] = 0; // the root
+	return encoder->length - start;
+}
+
+/**
+ Adds a question to the message. Questions have to be encoded before any records.
+ returns -1 if it doesnt fit.
+*/
+int encode_question(dns_encoder_t *encoder, dns_question_t *question){
+	int start = encoder->length;
+	int name_no = encoder->name_no;
+	if(encode_name(encoder, question->QName) < 0 || encoder->length + 4 > encoder->size){
+		encoder->length = start;
+		encoder->name_no = name_no;
+		return -1;
+	}
+	char *data = encoder->buf + encoder->length;
+	((uint16_t *)data)[0] = htons(question->QType);
+	((uint16_t *)data)[1] = htons(question->QClass);
+	encoder->length += 4;
+	encoder->counts[0]++;
+	encoder->question_end = encoder->length;
+	encoder->question_names = encoder->name_no;
+	return 0;
+}
+
+/**
+ Adds a record to a section of the message (ANSWER, AUTHORITY or ADDITIONAL), named owner.
+ Names in the RData of the types that have them are compressed too.
+ If the record doesnt fit nothing is written.
+
+ returns the offset of the record's TTL in the message, so it can be changed later, or -1 if it doesnt fit.
+*/
+int encode_record(dns_encoder_t *encoder, int section, char *owner, dns_resource_record_t *rr){
+	int start = encoder->length;
+	int name_no = encoder->name_no;
+	if(encode_name(encoder, owner) < 0 || encoder->length + 10 > encoder->size){
+		goto full;
+	}
+	char *data = encoder->buf + encoder->length;
+	((uint16_t *)data)[0] = htons(rr->Type);
+	((uint16_t *)data)[1] = htons(rr->Class);
+	((uint32_t *)data)[1] = htonl(rr->TTL);
+	encoder->length += 10;
+
+	int rdata_start = encoder->length;
+	int prefix, suffix;
+	int names = rdata_names(rr->Type, &prefix, &suffix);
+	if(names == 0){
+		prefix = rr->RDLength; // its all just bytes.
+	}
+	if(encoder->length + prefix > encoder->size){
+		goto full;
+	}
+	char *rdata = rr->RData;
+	memcpy(encoder->buf + encoder->length, rdata, prefix);
+	encoder->length += prefix;
+	rdata += prefix;
+	for(int i = 0; i < names; i ++){
+		if(encode_name(encoder, rdata) < 0){
+			goto full;
+		}
+		rdata += domainname_length(rdata);
+	}
+	if(encoder->length + suffix > encoder->size){
+		goto full;
+	}
+	memcpy(encoder->buf + encoder->length, rdata, suffix);
+	encoder->length += suffix;
+
+	((uint16_t *)data)[4] = htons(encoder->length - rdata_start);
+	encoder->counts[section]++;
+	return data + 4 - encoder->buf;
+
+full:
+	encoder->length = start;
+	encoder->name_no = name_no;
+	return -1;
+}
+
+/**
+ Throws away every record encoded so far and sets TC, so the client knows to ask again over TCP.
+ The questions stay.
+*/
+void encoder_truncate(dns_encoder_t *encoder){
+	encoder->length = encoder->question_end;
+	encoder->name_no = encoder->question_names;
+	encoder->counts[ANSWER] = 0;
+	encoder->counts[AUTHORITY] = 0;
+	encoder->counts[ADDITIONAL] = 0;
+	encoder->buf[2] |= 0x02; // TC
+}
+
+/**
+ Puts the counts in the header.
+ returns the length of the message.
+*/
+int encoder_finish(dns_encoder_t *encoder){
+	for(int i = 0; i < 4; i ++){
+		((uint16_t *)encoder->buf)[2+i] = htons(encoder->counts[i]);
+	}
+	return encoder->length;
+}
+
+/**
+ Writes a packet in wire format into buf, which is n bytes long, with names compressed.
+ If the answer and authority sections dont fit they are left out and TC is set.
+ Additional records that dont fit are just left out (they are only there to save lookups),
+ except an OPT record, which always has room kept for it.
+
+ returns the number of bytes written, or -1 if not even the questions fit.
+*/
+int write_packet(dns_packet_t *packet, void *buf, int n){
+	if(n < 12){
+		return -1;
+	}
+	dns_encoder_t encoder;
+	encoder_init(&encoder, buf, n, &packet->header);
+
+	for(int i = 0; i < packet->header.QDCount; i ++){
+		if(encode_question(&encoder, packet->questions[i]) < 0){
+			return -1;
+		}
+	}
+
+	dns_resource_record_t *opt = NULL;
+	for(int i = 0; i < packet->header.ARCount; i ++){
+		if(packet->additional[i]->Type == T_OPT){
+			opt = packet->additional[i];
+		}
+	}
+	if(opt != NULL){
+		encoder.size -= OPT_SIZE + opt->RDLength;
+	}
+
+	dns_resource_record_t **sections[3] = {packet->answers, packet->authorities, packet->additional};
+	int counts[3] = {packet->header.ANCount, packet->header.NSCount, packet->header.ARCount};
+	for(int s = 0; s < 3; s ++){
+		for(int i = 0; i < counts[s]; i ++){
+			dns_resource_record_t *rr = sections[s][i];
+			if(rr == opt){
+				continue;
+			}
+			if(encode_record(&encoder, ANSWER + s, rr->Name, rr) < 0){
+				if(s != 2){
+					encoder_truncate(&encoder);
+				}
+				s = 3; // nothing else goes in.
+				break;
+			}
+		}
+	}
+
+	if(opt != NULL){
+		encoder.size = n;
+		if(encode_record(&encoder, ADDITIONAL, opt->Name, opt) < 0){
+			return -1;
+		}
+	}
+	return encoder_finish(&encoder);
+}
+
+/**
+ Writes a resource record at offset into a packet that is n bytes long.
+
+ returns the number of bytes written, or -1 if it does not fit.
+*/
+int write_resource_record(void *packet_start, int offset, int n, dns_resource_record_t *rr){
+	int length = domainname_length(rr->Name);
+	if(offset + length + 10 + rr->RDLength > n){
+		return -1;
+	}
+	void *data = packet_start + offset;
+	memcpy(data, rr->Name, length);
+	((uint16_t *)(data + length))[0] = htons(rr->Type);
+	((uint16_t *)(data + length))[1] = htons(rr->Class);
+	((uint32_t *)(data + length))[1] = htonl(rr->TTL);
+	((uint16_t *)(data + length))[4] = htons(rr->RDLength);
+	memcpy(data+length+10, rr->RData, rr->RDLength);
 	return length + 10 + rr->RDLength;
 }
 
+/**
+ Fills in an EDNS0 OPT pseudo record advertising the UDP payload size we can take.
+ rcode is the full RCode of a response, the OPT carries the bits that dont fit in the header (like BADVERS),
+ pass 0 for a query.
+*/
+void init_opt(dns_resource_record_t *opt, uint16_t payload_size, int rcode){
+	opt->Name = ""; // the root
+	opt->Type = T_OPT;
+	opt->Class = payload_size;
+	opt->TTL = (uint32_t)(rcode >> 4) << 24; // version 0, no flags.
+	opt->RDLength = 0;
+	opt->RData = "";
+}
+
+/**
+ Returns the UDP payload size the sender of a packet can take, never less than 512,
+ or 0 if it didnt use EDNS0.
+*/
+int edns_payload_size(dns_packet_t *packet){
+	if(packet->opt == NULL){
+		return 0;
+	}
+	return packet->opt->Class < 512 ? 512 : packet->opt->Class;
+}
+
+/**
+ Returns the EDNS version a packet was sent with, or -1 if it didnt use EDNS0.
+*/
+int edns_version(dns_packet_t *packet){
+	if(packet->opt == NULL){
+		return -1;
+	}
+	return (packet->opt->TTL >> 16) & 0xFF;
+}
+
+/**
+ Takes the OPT record out of message, which is length bytes long and what packet was parsed from.
+ Records in the packet that came after the OPT point at the wrong bytes after this.
+
+ returns the new length of the message.
+*/
+int remove_opt(dns_packet_t *packet, char *message, int length){
+	if(packet->opt == NULL){
+		return length;
+	}
+	char *start = packet->opt->Name;
+	char *end = (char *)packet->opt->RData + packet->opt->RDLength;
+	memmove(start, end, message + length - end);
+
+	packet->header.ARCount--;
+	((uint16_t *)message)[5] = htons(packet->header.ARCount);
+	packet->opt = NULL;
+	return length - (end - start);
+}
+
+/**
+ Adds an OPT record advertising payload_size to the end of message, which is length bytes long and has room for n.
+ returns the new length of the message, or -1 if it doesnt fit.
+*/
+int append_opt(char *message, int length, int n, uint16_t payload_size){
+	dns_resource_record_t opt;
+	init_opt(&opt, payload_size, 0);
+	int written = write_resource_record(message, length, n, &opt);
+	if(written < 0){
+		return -1;
+	}
+	((uint16_t *)message)[5] = htons(ntohs(((uint16_t *)message)[5]) + 1);
+	return length + written;
+}
+
 void print_packet(dns_packet_t *packet){
 	printf("DNS PACKET ID %x\n", packet->header.QID);
 	printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
@@ -297,15 +845,19 @@ void print_packet(dns_packet_t *packet){
 }
 
 void print_question(dns_question_t *question){
+	char name[256];
+	domainname_to_string(question->QName, name);
 	printf("QUESTION: \n");
-	printf("Name: %s\n", question->QName);
+	printf("Name: %s\n", name);
 	printf("Type: %d\n", question->QType);
 	printf("Class: %d\n", question->QClass);
 }
 
 void print_rr(dns_resource_record_t *rr){
+	char name[256];
+	domainname_to_string(rr->Name, name);
 	printf("RESOURCE RECORD:\n");
-	printf("Name: %s\n", rr->Name);
+	printf("Name: %s\n", name);
 	printf("Type: %d\n", rr->Type);
 	printf("Class: %d\n", rr->Class);
 	printf("TTL: %d seconds\n", rr->TTL);
@@ -3,11 +3,13 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 enum TYPE {
 		T_A=1, T_NS=2, T_MD=3, T_MF=4, T_CNAME=5, T_SOA=6,
 			T_MB=7, T_MG=8, T_MR=9, T_NULL=10, T_WKS=11,
-			T_PTR=12, T_HINFO=13, T_MINFO=14, T_MX=15, T_TXT=16, T_OPT=41
+			T_PTR=12, T_HINFO=13, T_MINFO=14, T_MX=15, T_TXT=16, T_AAAA=28,
+			T_SRV=33, T_OPT=41
 };
 
 enum QTYPE {
@@ -27,14 +29,16 @@ enum QCLASS {
 		QC_ALL=255
 };
 
+// Names are held in wire format, uncompressed length prefixed labels ending with the root label.
+// Parsed names and RData point into the packet (or the arena it was parsed with).
 typedef struct dns_question{
-	char QName[256];
+	char *QName;
 	uint16_t QType;
 	uint16_t QClass;
 }dns_question_t;
 
 typedef struct dns_resource_record{
-	char Name[256];
+	char *Name;
 	uint16_t Type;
 	uint16_t Class;
 	uint32_t TTL;
@@ -64,11 +68,68 @@ typedef struct dns_packet{
 	dns_resource_record_t **answers;
 	dns_resource_record_t **authorities;
 	dns_resource_record_t **additional;
+	// EDNS0 OPT pseudo record, also in additional. Set by parse_packet, NULL if the sender didnt use EDNS0.
+	// Its Class is the sender's UDP payload size, and its TTL holds the extended RCode, version and flags.
+	dns_resource_record_t *opt;
 } dns_packet_t;
 
-dns_packet_t *parse_packet(void *data, int n);
-int parse_question(void *,int, dns_question_t *);
-int parse_resource_record(void *, int, dns_resource_record_t *);
+// Sections of a message, as indexes into dns_encoder_t.counts.
+enum SECTION {
+		QUESTION=0, ANSWER=1, AUTHORITY=2, ADDITIONAL=3
+};
+
+//Most name endings an encoder remembers to point later names at.
+#define MAX_COMPRESSION 64
+//Bytes an OPT record with no options takes up.
+#define OPT_SIZE 11
+
+// Writes a message straight into a send buffer, a question or record at a time, with names compressed.
+// Everything it needs is in here, so it can live on the stack.
+typedef struct dns_encoder{
+	char *buf;
+	int size; // bytes of buf it can write, can be lowered to keep room for a record that has to go last.
+	int length; // bytes written so far.
+	int question_end; // where the records start, truncating goes back to here.
+	int question_names;
+	uint16_t counts[4]; // questions and records written to each section.
+	int name_no;
+	uint16_t names[MAX_COMPRESSION]; // offsets of name endings already written, that later names can point to.
+} dns_encoder_t;
+
+// Per-packet scratch memory for the parser, everything in it goes at once with arena_reset.
+typedef struct dns_arena{
+	char *base;
+	size_t size;
+	size_t used;
+} dns_arena_t;
+
+void arena_init(dns_arena_t *arena, void *buf, size_t size);
+void *arena_alloc(dns_arena_t *arena, size_t size);
+void arena_reset(dns_arena_t *arena);
+
+dns_packet_t *parse_packet(void *data, int n, dns_arena_t *arena);
+int parse_question(void *, int, int, dns_arena_t *, dns_question_t *);
+int parse_resource_record(void *, int, int, dns_arena_t *, dns_resource_record_t *);
+int read_domainname(void *packet_start, int offset, int n, char *output);
+int domainname_length(char *name);
+int rdata_names(uint16_t type, int *prefix, int *suffix);
+int name_span(char *name, int length);
+bool rdata_valid(uint16_t type, char *rdata, int length);
+void domainname_to_string(char *name, char *output);
+int string_to_domainname(char *name, char *output);
+
+void encoder_init(dns_encoder_t *encoder, void *buf, int size, dns_header_t *header);
+int encode_question(dns_encoder_t *encoder, dns_question_t *question);
+int encode_record(dns_encoder_t *encoder, int section, char *owner, dns_resource_record_t *rr);
+void encoder_truncate(dns_encoder_t *encoder);
+int encoder_finish(dns_encoder_t *encoder);
+int write_packet(dns_packet_t *packet, void *buf, int n);
+
+void init_opt(dns_resource_record_t *opt, uint16_t payload_size, int rcode);
+int edns_payload_size(dns_packet_t *packet);
+int edns_version(dns_packet_t *packet);
+int remove_opt(dns_packet_t *packet, char *message, int length);
+int append_opt(char *message, int length, int n, uint16_t payload_size);
 
 void print_packet(dns_packet_t *packet);
 void print_question(dns_question_t *question);
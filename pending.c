@@ -0,0 +1,329 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pending.h"
+
+uint32_t pending_hash(dns_question_t *);
+bool pending_matches(dns_pending_t *, uint32_t, dns_question_t *);
+void timer_link(dns_pending_table_t *, int);
+void timer_unlink(dns_pending_table_t *, int);
+void timer_move(dns_pending_table_t *, int, int);
+
+/**
+ Sets up an empty table with room for capacity queries, capacity must be a power of two.
+ waiter_capacity is how many clients can be waiting across all of them.
+ now is the time in ms the timer wheel starts at.
+ returns -1 if the table could not be allocated.
+*/
+int pending_init(dns_pending_table_t *table, int capacity, int waiter_capacity, uint64_t now){
+	table->entries = calloc(capacity, sizeof(dns_pending_t));
+	table->waiters = calloc(waiter_capacity, sizeof(dns_waiter_t));
+	if(table->entries == NULL || table->waiters == NULL){
+		free(table->entries);
+		free(table->waiters);
+		return -1;
+	}
+	table->capacity = capacity;
+	table->count = 0;
+
+	for(int i = 0; i < waiter_capacity; i++){
+		table->waiters[i].next = i + 1;
+	}
+	table->waiters[waiter_capacity - 1].next = -1;
+	table->free_waiters = 0;
+
+	for(int i = 0; i < TIMER_SLOTS; i++){
+		table->timers[i] = -1;
+	}
+	table->tick = now / TIMER_TICK;
+	return 0;
+}
+
+/**
+ FNV-1a over the question.
+ The name is hashed exactly as it was sent, an answer has to echo the question back the same way.
+*/
+uint32_t pending_hash(dns_question_t *question){
+	uint32_t hash = 2166136261u;
+	uint16_t fields[2] = {question->QType, question->QClass};
+	unsigned char *bytes = (unsigned char *)fields;
+	for(int i = 0; i < sizeof(fields); i++){
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	int length = domainname_length(question->QName);
+	for(int i = 0; i < length; i++){
+		hash = (hash ^ (unsigned char)question->QName[i]) * 16777619u;
+	}
+	return hash;
+}
+
+bool pending_matches(dns_pending_t *entry, uint32_t hash, dns_question_t *question){
+	return entry->hash == hash
+		&& entry->qtype == question->QType && entry->qclass == question->QClass
+		&& memcmp(entry->qname, question->QName, domainname_length(question->QName)) == 0;
+}
+
+/**
+ Adds a query that is going upstream with the given QID, there must not already be one for the question.
+ The caller adds the clients waiting on it and sets its timer.
+ The table is kept at most 3/4 full so probes stay short.
+
+ returns the new entry, or NULL if the table is full.
+*/
+dns_pending_t *pending_add(dns_pending_table_t *table, uint16_t qid, dns_question_t *question){
+	if((table->count + 1) * 4 > table->capacity * 3){
+		return NULL;
+	}
+	uint32_t hash = pending_hash(question);
+	uint32_t mask = table->capacity - 1;
+	uint32_t i = hash & mask;
+	while(table->entries[i].used){
+		i = (i + 1) & mask;
+	}
+
+	dns_pending_t *entry = &table->entries[i];
+	entry->used = true;
+	entry->hash = hash;
+	entry->qid = qid;
+	memcpy(entry->qname, question->QName, domainname_length(question->QName));
+	entry->qtype = question->QType;
+	entry->qclass = question->QClass;
+	entry->waiters = -1;
+	entry->waiter_count = 0;
+	entry->tcp = false;
+	entry->no_edns = false;
+	entry->refresh = false;
+	entry->zone[0] = 0;
+	entry->server_no = 0;
+	entry->steps = 0;
+	entry->timer_next = -1;
+	entry->timer_prev = -1;
+	entry->deadline = 0;
+	table->count++;
+	return entry;
+}
+
+/**
+ Finds the query that is upstream for this question.
+ Answers must also be checked against the entry's QID.
+ returns NULL if we arent waiting on one.
+*/
+dns_pending_t *pending_find(dns_pending_table_t *table, dns_question_t *question){
+	uint32_t hash = pending_hash(question);
+	uint32_t mask = table->capacity - 1;
+	for(uint32_t i = hash & mask; table->entries[i].used; i = (i + 1) & mask){
+		if(pending_matches(&table->entries[i], hash, question)){
+			return &table->entries[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ Finds an entry by the hash of its question and the QID it went upstream with, for a dependent waiter.
+ returns NULL if it isnt pending any more.
+*/
+dns_pending_t *pending_find_id(dns_pending_table_t *table, uint32_t hash, uint16_t qid){
+	uint32_t mask = table->capacity - 1;
+	for(uint32_t i = hash & mask; table->entries[i].used; i = (i + 1) & mask){
+		if(table->entries[i].hash == hash && table->entries[i].qid == qid){
+			return &table->entries[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ Adds a client to the ones waiting on an entry.
+ A client resending the same query is only added once, so it only gets one answer.
+ returns 1 if it was already waiting, -1 if there are too many clients waiting already.
+*/
+int pending_add_waiter(dns_pending_table_t *table, dns_pending_t *entry, uint16_t qid, dns_client_t *client){
+	for(int w = entry->waiters; w >= 0; w = table->waiters[w].next){
+		dns_waiter_t *waiter = &table->waiters[w];
+		if(!waiter->dependent && waiter->qid == qid && waiter->client.conn == client->conn && waiter->client.generation == client->generation
+				&& waiter->client.addr_length == client->addr_length
+				&& memcmp(&waiter->client.addr, &client->addr, client->addr_length) == 0){
+			return 1;
+		}
+	}
+	if(table->free_waiters < 0){
+		return -1;
+	}
+	int w = table->free_waiters;
+	dns_waiter_t *waiter = &table->waiters[w];
+	table->free_waiters = waiter->next;
+
+	waiter->qid = qid;
+	waiter->dependent = false;
+	waiter->client = *client;
+	waiter->next = entry->waiters;
+	entry->waiters = w;
+	entry->waiter_count++;
+	return 0;
+}
+
+/**
+ Adds another pending query to the ones waiting on an entry, unless it is already.
+ returns -1 if there are no free waiters.
+*/
+int pending_add_dependent(dns_pending_table_t *table, dns_pending_t *entry, dns_pending_t *dependent){
+	for(int w = entry->waiters; w >= 0; w = table->waiters[w].next){
+		dns_waiter_t *waiter = &table->waiters[w];
+		if(waiter->dependent && waiter->hash == dependent->hash && waiter->qid == dependent->qid){
+			return 0;
+		}
+	}
+	if(table->free_waiters < 0){
+		return -1;
+	}
+	int w = table->free_waiters;
+	dns_waiter_t *waiter = &table->waiters[w];
+	table->free_waiters = waiter->next;
+
+	waiter->qid = dependent->qid;
+	waiter->dependent = true;
+	waiter->hash = dependent->hash;
+	waiter->next = entry->waiters;
+	entry->waiters = w;
+	entry->waiter_count++;
+	return 0;
+}
+
+/**
+ Lets go of the clients waiting on an entry, once they have been answered some other way.
+ Pending queries waiting on it stay.
+*/
+void pending_release_clients(dns_pending_table_t *table, dns_pending_t *entry){
+	int *link = &entry->waiters;
+	while(*link >= 0){
+		int w = *link;
+		dns_waiter_t *waiter = &table->waiters[w];
+		if(waiter->dependent){
+			link = &waiter->next;
+			continue;
+		}
+		*link = waiter->next;
+		waiter->next = table->free_waiters;
+		table->free_waiters = w;
+		entry->waiter_count--;
+	}
+}
+
+/**
+ Takes an entry out of the table, its waiters go back to the pool and its timer is cancelled.
+ Later entries in the probe run are shifted back into the hole, so entry may now hold a different query.
+*/
+void pending_remove(dns_pending_table_t *table, dns_pending_t *entry){
+	if(entry->deadline != 0){
+		timer_unlink(table, entry - table->entries);
+	}
+
+	for(int w = entry->waiters; w >= 0;){
+		int next = table->waiters[w].next;
+		table->waiters[w].next = table->free_waiters;
+		table->free_waiters = w;
+		w = next;
+	}
+
+	uint32_t mask = table->capacity - 1;
+	uint32_t hole = entry - table->entries;
+	table->entries[hole].used = false;
+	table->count--;
+
+	for(uint32_t i = (hole + 1) & mask; table->entries[i].used; i = (i + 1) & mask){
+		uint32_t home = table->entries[i].hash & mask;
+		// move it back if its home slot is not between the hole and where it sits now
+		if(((i - home) & mask) >= ((i - hole) & mask)){
+			table->entries[hole] = table->entries[i];
+			table->entries[i].used = false;
+			timer_move(table, i, hole);
+			hole = i;
+		}
+	}
+}
+
+/**
+ Puts an entry in the timer wheel slot for its deadline, the time in ms.
+*/
+void timer_link(dns_pending_table_t *table, int i){
+	dns_pending_t *entry = &table->entries[i];
+	int slot = (entry->deadline / TIMER_TICK) % TIMER_SLOTS;
+	entry->timer_prev = -1;
+	entry->timer_next = table->timers[slot];
+	if(entry->timer_next >= 0){
+		table->entries[entry->timer_next].timer_prev = i;
+	}
+	table->timers[slot] = i;
+}
+
+void timer_unlink(dns_pending_table_t *table, int i){
+	dns_pending_t *entry = &table->entries[i];
+	if(entry->timer_prev >= 0){
+		table->entries[entry->timer_prev].timer_next = entry->timer_next;
+	}else{
+		table->timers[(entry->deadline / TIMER_TICK) % TIMER_SLOTS] = entry->timer_next;
+	}
+	if(entry->timer_next >= 0){
+		table->entries[entry->timer_next].timer_prev = entry->timer_prev;
+	}
+}
+
+/**
+ Points the wheel at an entry that pending_remove just moved from slot from to slot to.
+*/
+void timer_move(dns_pending_table_t *table, int from, int to){
+	dns_pending_t *entry = &table->entries[to];
+	if(entry->deadline == 0){
+		return;
+	}
+	if(entry->timer_prev >= 0){
+		table->entries[entry->timer_prev].timer_next = to;
+	}else{
+		table->timers[(entry->deadline / TIMER_TICK) % TIMER_SLOTS] = to;
+	}
+	if(entry->timer_next >= 0){
+		table->entries[entry->timer_next].timer_prev = to;
+	}
+}
+
+/**
+ Sets (or moves) an entry's timer to go off at deadline, a time in ms.
+*/
+void pending_set_timer(dns_pending_table_t *table, dns_pending_t *entry, uint64_t deadline){
+	int i = entry - table->entries;
+	if(entry->deadline != 0){
+		timer_unlink(table, i);
+	}
+	// a deadline in a tick we have already looked at would never be found.
+	if(deadline / TIMER_TICK < table->tick){
+		deadline = table->tick * TIMER_TICK;
+	}
+	entry->deadline = deadline;
+	timer_link(table, i);
+}
+
+/**
+ Finds an entry whose timer has gone off by now, a time in ms, and takes it out of the wheel.
+ The caller should either set a new timer on it or remove it. Call it until it returns NULL.
+
+ returns the entry, or NULL if there are no more.
+*/
+dns_pending_t *pending_next_expired(dns_pending_table_t *table, uint64_t now){
+	uint64_t now_tick = now / TIMER_TICK;
+	while(table->tick <= now_tick){
+		// entries a whole turn of the wheel or more away share the slot, so check the deadline.
+		for(int i = table->timers[table->tick % TIMER_SLOTS]; i >= 0; i = table->entries[i].timer_next){
+			dns_pending_t *entry = &table->entries[i];
+			if(entry->deadline / TIMER_TICK <= now_tick){
+				timer_unlink(table, i);
+				entry->deadline = 0;
+				return entry;
+			}
+		}
+		if(table->tick == now_tick){
+			break; // timers later in this tick can still be set, so stay on it.
+		}
+		table->tick++;
+	}
+	return NULL;
+}
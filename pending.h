@@ -0,0 +1,94 @@
+#ifndef PENDING_H
+#define PENDING_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "dns.h"
+
+//ms each slot of the timer wheel covers.
+#define TIMER_TICK 50
+//Slots in the timer wheel, deadlines further off than this many ticks just go round again.
+#define TIMER_SLOTS 256
+//Most servers of a zone an iterative query keeps the addresses of.
+#define ZONE_SERVERS 8
+
+// Who a reply goes to, an address for UDP or a connection for TCP.
+typedef struct dns_client{
+	struct sockaddr_storage addr; // UDP only
+	socklen_t addr_length;
+	int conn; // worker's TCP connection it asked on, -1 for UDP
+	uint32_t generation; // of the connection, so replies dont go down a reused one
+	uint16_t edns; // UDP payload size it asked with EDNS0, 0 if it didnt use EDNS0
+} dns_client_t;
+
+// A client waiting on the answer to a pending query.
+// Or another pending query, which has to know a server's address or where a CNAME leads before it can go on.
+typedef struct dns_waiter{
+	uint16_t qid; // QID the client asked with, to put back on the answer. Or the QID of the pending query.
+	bool dependent; // its a pending query, found again by its hash and QID as it may have moved.
+	uint32_t hash;
+	dns_client_t client;
+	int next; // next waiter on the same query, or in the free list. -1 ends it
+} dns_waiter_t;
+
+// A query we have sent upstream and are waiting on the answer for.
+typedef struct dns_pending{
+	bool used;
+	uint32_t hash; // of the question, see pending_hash
+	uint16_t qid; // QID the query went upstream with
+	char qname[255];
+	uint16_t qtype;
+	uint16_t qclass;
+
+	int waiters; // first client waiting on this, -1 if none
+	int waiter_count;
+	int upstream; // which upstream socket it went out on, the answer has to come back on it
+	bool tcp; // the UDP answer was truncated, so it goes over TCP now
+	bool no_edns; // the server didnt understand EDNS0, so it is asked without
+	bool refresh; // asked to refresh cached records before they run out, so the cache mustnt answer it
+
+	// when resolving iteratively, the zone the query is at and the addresses of its servers, which server and tried index.
+	char zone[255];
+	struct sockaddr_in servers[ZONE_SERVERS];
+	int server_no;
+	int steps; // referrals followed and other queries waited on, so a loop ends
+
+	int server; // upstream server the last attempt went to, or one of servers
+	uint32_t tried; // bitmask of servers it has been sent to
+	int attempts;
+	uint64_t started; // ms, when the first attempt went out
+	uint64_t last_sent; // ms, when the last attempt went out
+
+	uint64_t deadline; // ms, when the timer goes off
+	int timer_next; // neighbours in the timer wheel slot, -1 ends the list
+	int timer_prev;
+} dns_pending_t;
+
+// Pending queries, an open addressing table keyed by question. Only one query per question goes upstream.
+typedef struct dns_pending_table{
+	int capacity; // a power of two
+	int count;
+	dns_pending_t *entries;
+
+	dns_waiter_t *waiters; // pool every entry's waiters come from
+	int free_waiters;
+
+	// timer wheel, every entry is in the slot for its deadline.
+	int timers[TIMER_SLOTS]; // first entry in each slot, -1 if empty
+	uint64_t tick; // next tick to look for expired timers in
+} dns_pending_table_t;
+
+int pending_init(dns_pending_table_t *table, int capacity, int waiter_capacity, uint64_t now);
+dns_pending_t *pending_add(dns_pending_table_t *table, uint16_t qid, dns_question_t *question);
+dns_pending_t *pending_find(dns_pending_table_t *table, dns_question_t *question);
+dns_pending_t *pending_find_id(dns_pending_table_t *table, uint32_t hash, uint16_t qid);
+int pending_add_waiter(dns_pending_table_t *table, dns_pending_t *entry, uint16_t qid, dns_client_t *client);
+int pending_add_dependent(dns_pending_table_t *table, dns_pending_t *entry, dns_pending_t *dependent);
+void pending_release_clients(dns_pending_table_t *table, dns_pending_t *entry);
+void pending_remove(dns_pending_table_t *table, dns_pending_t *entry);
+void pending_set_timer(dns_pending_table_t *table, dns_pending_t *entry, uint64_t deadline);
+dns_pending_t *pending_next_expired(dns_pending_table_t *table, uint64_t now);
+
+#endif
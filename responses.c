@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "responses.h"
+
+uint64_t question_hash(char *, int);
+bool response_current(dns_response_t *, time_t);
+
+/**
+ Sets up an empty cache with room for capacity responses, capacity must be a power of two.
+ returns -1 if the table could not be allocated.
+*/
+int responses_init(dns_response_cache_t *cache, int capacity){
+	cache->slots = calloc(capacity, sizeof(dns_response_t *));
+	if(cache->slots == NULL){
+		return -1;
+	}
+	cache->capacity = capacity;
+	return 0;
+}
+
+/**
+ Hashes the bytes of a question a word at a time. Names arent case folded,
+ so a question asked with different capitalisation is kept apart, and its answer echoes it as asked.
+*/
+uint64_t question_hash(char *question, int length){
+	uint64_t hash = length;
+	while(length > 0){
+		uint64_t word = 0;
+		int n = length < 8 ? length : 8;
+		memcpy(&word, question, n);
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+		hash ^= hash >> 29;
+		question += 8;
+		length -= 8;
+	}
+	return hash;
+}
+
+/**
+ Checks a response is still what the cache would answer: none of its records have run out or are due to be refreshed,
+ and none of the domains it was made from have changed.
+*/
+bool response_current(dns_response_t *response, time_t now){
+	if((response->expires != 0 && response->expires <= now) || (response->refresh != 0 && response->refresh <= now)){
+		return false;
+	}
+	for(int i = 0; i < response->domain_no; i++){
+		if(cache_generation(response->slots[i]) != response->generations[i]){
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ Finds the response for a question, given as the raw bytes that follow the header.
+ A response that is out of date is thrown away, one that is current has its TTLs brought up to now.
+
+ returns the response, or NULL if there isnt a current one.
+*/
+dns_response_t *response_find(dns_response_cache_t *cache, char *question, int question_length, time_t now){
+	uint64_t hash = question_hash(question, question_length);
+	dns_response_t **slot = &cache->slots[hash & (cache->capacity - 1)];
+	dns_response_t *response = *slot;
+	if(response == NULL || response->hash != hash || response->question_length != question_length
+			|| memcmp(response->message + 12, question, question_length) != 0){
+		return NULL;
+	}
+	if(!response_current(response, now)){
+		free(response);
+		*slot = NULL;
+		return NULL;
+	}
+
+	if(response->updated != now){
+		for(int i = 0; i < response->record_no; i++){
+			if(response->record_expires[i] != 0){
+				uint32_t ttl = htonl(response->record_expires[i] - now);
+				memcpy(response->message + response->ttl_offsets[i], &ttl, 4);
+			}
+		}
+		response->updated = now;
+	}
+	return response;
+}
+
+/**
+ Keeps a copy of an answer from the cache, made from source, which is length bytes long with a question_length byte question.
+ It replaces whatever response was in its slot. Answers with too many records to keep track of arent kept,
+ nor are ones with records due to be refreshed, as they wouldnt be current anyway.
+*/
+void response_store(dns_response_cache_t *cache, char *message, int length, int question_length, dns_answer_source_t *source){
+	time_t now = time(NULL);
+	if(source->record_no < 0 || (source->refresh != 0 && source->refresh <= now)){
+		return;
+	}
+	int record_no = source->record_no;
+	dns_response_t *response = malloc(sizeof(dns_response_t) + record_no * (sizeof(time_t) + sizeof(uint16_t)) + length);
+	if(response == NULL){
+		return; // its only a copy, the cache still has the answer.
+	}
+	response->hash = question_hash(message + 12, question_length);
+	response->question_length = question_length;
+	response->length = length;
+	response->updated = now;
+	response->refresh = source->refresh;
+	response->domain_no = source->domain_no;
+	memcpy(response->slots, source->slots, source->domain_no * sizeof(uint32_t));
+	memcpy(response->generations, source->generations, source->domain_no * sizeof(uint32_t));
+
+	response->record_no = record_no;
+	response->record_expires = (time_t *)(response + 1);
+	response->ttl_offsets = (uint16_t *)(response->record_expires + record_no);
+	response->message = (char *)(response->ttl_offsets + record_no);
+	memcpy(response->record_expires, source->expires, record_no * sizeof(time_t));
+	memcpy(response->ttl_offsets, source->ttl_offsets, record_no * sizeof(uint16_t));
+	memcpy(response->message, message, length);
+
+	response->expires = 0;
+	for(int i = 0; i < record_no; i++){
+		if(source->expires[i] != 0 && (response->expires == 0 || source->expires[i] < response->expires)){
+			response->expires = source->expires[i];
+		}
+	}
+
+	dns_response_t **slot = &cache->slots[response->hash & (cache->capacity - 1)];
+	free(*slot);
+	*slot = response;
+}
@@ -0,0 +1,38 @@
+#ifndef RESPONSES_H
+#define RESPONSES_H
+
+#include <stdint.h>
+#include <time.h>
+#include "storage.h"
+
+// A whole answer from the cache in wire format, kept so the next query with the same question
+// is answered by copying it rather than building it again.
+// The records' TTLs are in the message, and are brought up to date at most once a second.
+typedef struct dns_response{
+	uint64_t hash; // of the question bytes.
+	int question_length; // bytes of the question, right after the header.
+	int length;
+	time_t expires; // first time a record in it runs out, 0 if none do.
+	time_t refresh; // first time a record in it is due to be refreshed, after that the cache has to see the hits.
+	time_t updated; // when the TTLs were last brought up to date.
+	int domain_no;
+	uint32_t slots[MAX_CHAIN]; // see dns_answer_source_t
+	uint32_t generations[MAX_CHAIN];
+	int record_no;
+	time_t *record_expires; // these three point into the same allocation, after the struct.
+	uint16_t *ttl_offsets;
+	char *message;
+} dns_response_t;
+
+// A worker's copies of answers, a direct mapped table so a lookup is a single probe.
+// Each worker has its own, so nothing in here is shared or locked.
+typedef struct dns_response_cache{
+	int capacity; // a power of two.
+	dns_response_t **slots;
+} dns_response_cache_t;
+
+int responses_init(dns_response_cache_t *cache, int capacity);
+dns_response_t *response_find(dns_response_cache_t *cache, char *question, int question_length, time_t now);
+void response_store(dns_response_cache_t *cache, char *message, int length, int question_length, dns_answer_source_t *source);
+
+#endif
@@ -1,248 +1,1747 @@
+#define _GNU_SOURCE // for pthread_setaffinity_np
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/random.h>
+#include <signal.h>
 
 #include "dns.h"
 #include "storage.h"
+#include "pending.h"
+#include "upstream.h"
+#include "tcp.h"
+#include "responses.h"
+#include "zone.h"
 
+//Server we forward to if none are given with -u.
 #define DNS_ADDRESS "127.0.0.53"
 #define DNS_PORT 53
 
-//Number of slots in our buffer.
-#define BUFFER_SIZE 10
+//Most queries each worker can have waiting on upstream, a power of two.
+#define PENDING_SIZE 16384
+//Most clients each worker can have waiting on those queries.
+#define WAITERS_SIZE 16384
+//Most times we send a query upstream, to one server or another, before giving up.
+#define MAX_ATTEMPTS 4
+//ms after the first attempt that we give up and SERVFAIL, however many attempts that was.
+#define QUERY_DEADLINE 3000
+//ms after the first attempt that clients are answered with stale records, if the cache has any, as RFC 8767 suggests.
+//The query carries on to refresh them.
+#define STALE_TIMEOUT 1800
+//Sockets we send upstream queries from, each on its own random port.
+#define UPSTREAM_SOCKETS 16
+//Largest reply we send over UDP to clients that dont use EDNS0.
+#define UDP_SIZE 512
+//Largest UDP message we take, the payload size we advertise with EDNS0.
+//Clients that advertise more still get at most this much.
+#define EDNS_SIZE 4096
+//Answers each worker keeps ready to copy out, a power of two.
+#define RESPONSE_SLOTS 4096
+//Bytes of scratch memory for parsing one packet.
+#define ARENA_SIZE 65536
+//Most datagrams we receive or send in one syscall.
+#define BATCH_SIZE 64
+//Seconds between sweeps of the cache for expired records. The first worker starts them.
+#define SWEEP_INTERVAL 10
+//Seconds between snapshots of the cache, when given a file to keep them in with -s. The first worker starts them.
+#define SNAPSHOT_INTERVAL 600
+//TCP connections each worker can have open, to clients and upstream together.
+#define MAX_CONNS 1024
+//Most TCP connections each worker keeps to one upstream server.
+#define TCP_POOL 4
+//Queries we will have waiting on one upstream TCP connection before opening another.
+#define TCP_PIPELINE 32
+//ms a TCP connection can sit idle before we close it.
+#define TCP_IDLE 10000
+//ms we wait on a zone's server when resolving iteratively, before trying another.
+//We dont keep track of how each of them does, there are far too many.
+#define ITERATIVE_TIMEOUT 400
+//Most referrals an iterative query follows, and other queries it waits on, before it gives up.
+#define MAX_STEPS 16
+//Most queries that can be waiting on one other query when it finishes.
+#define MAX_DEPENDENTS 16
+
+//epoll data for a worker's events. UDP sockets use their index (0 for clients, 1 + i for upstream socket i),
+//TCP connection i is CONN_EVENT + i.
+#define TIMER_EVENT (UPSTREAM_SOCKETS + 1)
+#define TCP_LISTEN_EVENT (UPSTREAM_SOCKETS + 2)
+#define CONN_EVENT (UPSTREAM_SOCKETS + 3)
 
 typedef struct dns_message{
-	bool used;
-	struct sockaddr *sa;
+	int upstream; // which upstream socket it came in on, -1 if its from a client
+	struct sockaddr_storage sa;
+	socklen_t sa_length;
 	size_t message_length;
-	char message[512];
+	char message[EDNS_SIZE];
 } dns_message_t;
 
-sem_t empty;
-sem_t full;
-int emptySlots = BUFFER_SIZE;
-int fullSlots = 0;
+// Replies a worker has collected, sent all at once with sendmmsg.
+typedef struct dns_reply_batch{
+	int count;
+	struct mmsghdr headers[BATCH_SIZE];
+	struct iovec iovecs[BATCH_SIZE];
+	struct sockaddr_storage addresses[BATCH_SIZE];
+	char buffers[BATCH_SIZE][EDNS_SIZE];
+} dns_reply_batch_t;
+
+// A shard of the server, one thread pinned to a CPU running an event loop over its own sockets and timer.
+// The kernel spreads clients over the workers' sockets with SO_REUSEPORT, only the cache is shared.
+typedef struct worker{
+	int id;
+	int sd;
+	int tcp_sd;
+	int upstream_sds[UPSTREAM_SOCKETS];
+	int epoll_fd;
+	int timer_fd;
+	//every worker keeps its own view of how the servers are doing, so they dont share writes.
+	dns_upstream_t upstreams[MAX_UPSTREAMS];
+	time_t next_sweep;
+	time_t next_snapshot;
+	//queries that have been forwarded and are waiting for a response.
+	dns_pending_table_t pending_table;
+	//answers from the cache ready to be copied out again.
+	dns_response_cache_t responses;
+	//messages from the last recvmmsg.
+	dns_message_t messages[BATCH_SIZE];
+	struct mmsghdr headers[BATCH_SIZE];
+	struct iovec iovecs[BATCH_SIZE];
+	//replies to clients waiting to be flushed.
+	dns_reply_batch_t replies;
+	//TCP connections to clients and upstream servers, MAX_CONNS of them.
+	dns_tcp_conn_t *conns;
+	uint64_t next_idle_check;
+	//replies to TCP clients, and answers from upstream with our OPT put on, are put together here.
+	char scratch[TCP_MESSAGE_SIZE];
+	//looks things up in the cache without a lock, see cache_quiescent.
+	int reader;
+	pthread_t thread;
+} worker_t;
+
+worker_t *workers;
+int worker_no;
+
+//set by SIGUSR1, the first worker prints the cache's memory use on its next tick.
+volatile sig_atomic_t stats_requested = 0;
+//set by SIGTERM or SIGINT when we keep snapshots, the first worker takes one on its next tick and exits.
+volatile sig_atomic_t stop_requested = 0;
+//set by SIGHUP when we serve zones, the first worker has them loaded again on its next tick.
+volatile sig_atomic_t reload_requested = 0;
+//a reload is going, another one waits for it to finish.
+bool reloading = false;
 
-pthread_mutex_t messages_lock;
-pthread_mutex_t requests_lock;
-//incoming messages that havent been categorized
-dns_message_t message_buffer[BUFFER_SIZE];
-//requests that have been parsed and are waiting for a response.
-dns_message_t request_buffer[BUFFER_SIZE];
+//a sweep is going, the next one waits for it to finish.
+bool sweeping = false;
 
+//a periodic snapshot is being written, the next one waits for it and the last one at exit waits for it to finish.
+bool snapshotting = false;
 
-int sd;
+//file the cache is snapshotted to with -s, and warmed from at startup. NULL if we dont keep one.
+char *snapshot_path = NULL;
+
+//servers we forward queries to. When resolving iteratively they stand in for the root servers, if any are given.
+dns_upstream_t upstream_list[MAX_UPSTREAMS];
+int upstream_no;
+//set by -i, we resolve queries ourselves starting from the root servers instead of forwarding them.
+bool iterative = false;
+
+/**
+ Returns the time in ms on a clock that only goes forward.
+*/
+uint64_t now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-struct sockaddr_in dns_addr;
-int dns_struct_length;
+/**
+ Returns a random QID for a query going upstream, so answers cant be guessed.
+ Random bytes are fetched from the kernel in batches for each thread.
+*/
+uint16_t random_qid(){
+	static __thread uint16_t pool[256];
+	static __thread int left = 0;
+	if(left == 0){
+		if(getrandom(pool, sizeof(pool), 0) != sizeof(pool)){
+			printf("Failed to get random bytes\n");
+			exit(1); // we would rather stop than send guessable ids.
+		}
+		left = 256;
+	}
+	return pool[--left];
+}
 
 /**
-Method taken from https://opensource.apple.com/source/postfix/postfix-197/postfix/src/util/sock_addr.c
-Used to compare IP addresses in IPv4 and IPv6.
+ Opens a socket on a random port to send upstream queries from.
+ returns the socket, or -1 on failure.
 */
-int cmp_addr(const struct sockaddr *a, const struct sockaddr *b){
-	if(a->sa_family != b->sa_family){
-		return a->sa_family - b->sa_family;
+int open_upstream_socket(){
+	int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(s < 0){
+		return -1;
+	}
+	// port 0 has the kernel pick a random ephemeral port for us.
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if(bind(s, (struct sockaddr *)&addr, sizeof(addr))){
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/**
+ Writes a response to the request with no records and the given RCode, like SERVFAIL.
+ If the request used EDNS0 so does the response, which lets it carry extended RCodes like BADVERS.
+ returns the length of the response, or -1 if it doesnt fit in n bytes.
+*/
+int write_error(dns_packet_t *request, int rcode, char *out, int n){
+	dns_resource_record_t opt;
+	dns_resource_record_t *additional[1] = {&opt};
+	init_opt(&opt, EDNS_SIZE, rcode);
+
+	dns_packet_t response;
+	memset(&response.header, 0, sizeof(response.header));
+	response.header.QID = request->header.QID;
+	response.header.QR = 1;
+	response.header.OpCode = request->header.OpCode;
+	response.header.RD = request->header.RD;
+	response.header.RA = 1;
+	response.header.RCode = rcode & 0x0F;
+	response.header.QDCount = request->header.QDCount;
+	response.header.ARCount = request->opt != NULL ? 1 : 0;
+	response.questions = request->questions;
+	response.additional = additional;
+	return write_packet(&response, out, n);
+}
+
+/**
+ Tries to answer a query from the cache.
+ On a hit the response is encoded straight into out (n bytes long), and a copy is kept in responses.
+ If the answer doesnt fit, the response is empty with TC set so the client asks again over TCP.
+ With stale set records that have run out can be used too, those answers arent kept.
+ prefetch (if not NULL) is set if the answer's records are hot and should be refreshed before they run out.
+
+ returns the length of the response, or 0 if it has to go upstream.
+*/
+int answer_from_cache(dns_packet_t *request, char *out, int n, dns_response_cache_t *responses, bool stale, bool *prefetch){
+	if(request == NULL || request->header.QR != 0 || request->header.OpCode != 0 || request->header.QDCount != 1){
+		return 0;
+	}
+
+	dns_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.QID = request->header.QID;
+	header.QR = 1;
+	header.RD = request->header.RD;
+	header.RA = 1;
+
+	dns_encoder_t encoder;
+	encoder_init(&encoder, out, n, &header);
+	if(encode_question(&encoder, request->questions[0]) < 0){
+		return 0;
+	}
+	if(request->opt != NULL){
+		encoder.size -= OPT_SIZE; // it goes last, but has to fit even if the answer doesnt.
+	}
+
+	dns_answer_source_t source;
+	int count = lookup_records(request->questions[0], &encoder, &source, stale);
+	if(count == 0){
+		return 0;
+	}
+	if(prefetch != NULL){
+		*prefetch = source.prefetch;
+	}
+	if(count < 0){
+		encoder_truncate(&encoder);
+	}else if(!stale){
+		// kept without the OPT, that is put on for each client that wants it.
+		response_store(responses, out, encoder_finish(&encoder), encoder.question_end - 12, &source);
+	}
+
+	if(request->opt != NULL){
+		dns_resource_record_t opt;
+		init_opt(&opt, EDNS_SIZE, 0);
+		encoder.size = n;
+		encode_record(&encoder, ADDITIONAL, opt.Name, &opt);
+	}
+	return encoder_finish(&encoder);
+}
+
+/**
+ Tries to answer a query from the zones we serve, given with -z. These come before the cache, and the answers are
+ authoritative. They arent kept in responses, looking them up again is about as quick as checking a copy.
+ If the answer doesnt fit, the response is empty with TC set so the client asks again over TCP.
+
+ returns the length of the response, or 0 if the name isnt in one of our zones (or is delegated out of it).
+*/
+int answer_from_zones(dns_packet_t *request, char *out, int n){
+	if(request == NULL || request->header.QR != 0 || request->header.OpCode != 0 || request->header.QDCount != 1){
+		return 0;
+	}
+
+	dns_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.QID = request->header.QID;
+	header.QR = 1;
+	header.RD = request->header.RD;
+	header.RA = 1;
+
+	dns_encoder_t encoder;
+	encoder_init(&encoder, out, n, &header);
+	if(encode_question(&encoder, request->questions[0]) < 0){
+		return 0;
+	}
+	if(request->opt != NULL){
+		encoder.size -= OPT_SIZE;
+	}
+
+	int count = zone_answer(request->questions[0], &encoder);
+	if(count == 0){
+		return 0;
+	}
+	if(count < 0){
+		encoder_truncate(&encoder);
+	}
+
+	if(request->opt != NULL){
+		dns_resource_record_t opt;
+		init_opt(&opt, EDNS_SIZE, 0);
+		encoder.size = n;
+		encode_record(&encoder, ADDITIONAL, opt.Name, &opt);
+	}
+	return encoder_finish(&encoder);
+}
+
+/**
+ Tries to answer a query with a copy of an earlier answer from the cache, without parsing it.
+ Only plain queries are looked at: one uncompressed question, and nothing else but an OPT record.
+ Anything else, or a copy that is too big for the client, is left for handle_query to deal with.
+ Sets client->edns from the OPT.
+
+ returns the length of the reply written into out (n bytes long), or 0 if there wasnt a copy to use.
+*/
+int answer_from_responses(worker_t *worker, char *message, int length, dns_client_t *client, char *out, int n){
+	unsigned char *data = (unsigned char *)message;
+	// QR and OpCode 0, one question, no answers or authorities, and maybe an OPT.
+	if(length < 17 || (data[2] & 0xF8) != 0 || data[4] != 0 || data[5] != 1
+			|| (data[6] | data[7] | data[8] | data[9] | data[10]) != 0 || data[11] > 1){
+		return 0;
+	}
+	int question_length = 0;
+	while(12 + question_length < length && data[12 + question_length] != 0){
+		if(data[12 + question_length] > 63){
+			return 0; // compressed, leave it to the parser.
+		}
+		question_length += data[12 + question_length] + 1;
 	}
-	if(a->sa_family == AF_INET) {
-		return ((struct sockaddr_in *)a)->sin_addr.s_addr - ((struct sockaddr_in *)b)->sin_addr.s_addr;
-	}else if(a->sa_family == AF_INET6){
-		return memcmp((char *) &(((struct sockaddr_in6 *)a)->sin6_addr.s6_addr),
-						(char *) &(((struct sockaddr_in6 *)b)->sin6_addr.s6_addr),
-						sizeof(((struct sockaddr_in6 *)a)->sin6_addr.s6_addr));
+	question_length += 1 + 4; // root label, type and class.
+	int end = 12 + question_length;
+	if(end > length){
+		return 0;
 	}
+
+	int edns = 0;
+	if(data[11] == 1){
+		// owned by the root, then type, payload size, extended RCode, version, flags and the options length.
+		// the options have to fill the rest of the message exactly, anything else is the parser's to turn away.
+		if(end + OPT_SIZE > length || data[end] != 0 || ((data[end+1] << 8) | data[end+2]) != T_OPT || data[end+6] != 0
+				|| end + OPT_SIZE + ((data[end+9] << 8) | data[end+10]) != length){
+			return 0;
+		}
+		edns = (data[end+3] << 8) | data[end+4];
+		edns = edns < UDP_SIZE ? UDP_SIZE : edns > EDNS_SIZE ? EDNS_SIZE : edns;
+	}
+	int limit = client->conn >= 0 ? n : edns ? edns : UDP_SIZE;
+	if(zone_covers(message + 12)){
+		return 0; // our zones come before the cache.
+	}
+
+	dns_response_t *response = response_find(&worker->responses, message + 12, question_length, time(NULL));
+	if(response == NULL || response->length + (edns ? OPT_SIZE : 0) > limit){
+		return 0;
+	}
+	memcpy(out, response->message, response->length);
+	memcpy(out, message, 2); // their QID
+	out[2] = (out[2] & ~0x01) | (message[2] & 0x01); // and their RD
+	client->edns = edns;
+	if(edns){
+		return append_opt(out, response->length, n, EDNS_SIZE);
+	}
+	return response->length;
+}
+
+/**
+ Sends every reply collected in the worker's batch, with one sendmmsg if all goes well.
+ A reply that cant be sent is dropped and the rest still go, the client will ask again.
+*/
+void flush_replies(worker_t *worker){
+	dns_reply_batch_t *replies = &worker->replies;
+	int sent = 0;
+	while(sent < replies->count){
+		int n = sendmmsg(worker->sd, replies->headers + sent, replies->count - sent, 0);
+		if(n < 0){
+			if(errno != EINTR){
+				printf("Failed to send\n");
+				sent++; // its always the first one that failed.
+			}
+			continue;
+		}
+		sent += n;
+	}
+	replies->count = 0;
+}
+
+/**
+ Returns the buffer the next reply should be written into, EDNS_SIZE bytes long.
+ It is only sent once queue_reply is called, so it can be abandoned.
+*/
+char *reply_buffer(worker_t *worker){
+	if(worker->replies.count == BATCH_SIZE){
+		flush_replies(worker);
+	}
+	return worker->replies.buffers[worker->replies.count];
+}
+
+/**
+ Queues the reply written into reply_buffer to be sent to the given address on the next flush.
+*/
+void queue_reply(worker_t *worker, int length, struct sockaddr *to, socklen_t to_length){
+	dns_reply_batch_t *replies = &worker->replies;
+	int i = replies->count;
+	memcpy(&replies->addresses[i], to, to_length);
+	replies->iovecs[i].iov_base = replies->buffers[i];
+	replies->iovecs[i].iov_len = length;
+	memset(&replies->headers[i].msg_hdr, 0, sizeof(replies->headers[i].msg_hdr));
+	replies->headers[i].msg_hdr.msg_name = &replies->addresses[i];
+	replies->headers[i].msg_hdr.msg_namelen = to_length;
+	replies->headers[i].msg_hdr.msg_iov = &replies->iovecs[i];
+	replies->headers[i].msg_hdr.msg_iovlen = 1;
+	replies->count++;
+}
+
+/**
+ Makes epoll watch a connection for writes only while it has something waiting to be written.
+*/
+void watch_conn(worker_t *worker, int i){
+	dns_tcp_conn_t *conn = &worker->conns[i];
+	bool want_write = conn->connecting || conn->out_length > 0;
+	bool reading = !conn->read_closed; // or it would say its readable at the end forever.
+	if(want_write == conn->want_write && reading == conn->reading){
+		return;
+	}
+	struct epoll_event event;
+	event.events = (reading ? EPOLLIN : 0) | (want_write ? EPOLLOUT : 0);
+	event.data.u32 = CONN_EVENT + i;
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+	conn->want_write = want_write;
+	conn->reading = reading;
+}
+
+/**
+ Writes what a connection has waiting, and closes it if it broke.
+ A client that has shut its side is closed once everything it asked is answered and written.
+*/
+void flush_conn(worker_t *worker, int i){
+	dns_tcp_conn_t *conn = &worker->conns[i];
+	if(tcp_flush(conn) < 0 || (conn->read_closed && conn->waiting == 0 && conn->out_length == 0)){
+		tcp_close(conn);
+		return;
+	}
+	watch_conn(worker, i);
+}
+
+/**
+ Takes a free connection slot for a socket and starts watching it.
+ returns the slot, or -1 if there are none free (the socket is closed).
+*/
+int add_conn(worker_t *worker, int fd, struct sockaddr_in *server, bool connecting){
+	int i = 0;
+	while(i < MAX_CONNS && worker->conns[i].fd >= 0){
+		i++;
+	}
+	if(i == MAX_CONNS){
+		close(fd);
+		return -1;
+	}
+	dns_tcp_conn_t *conn = &worker->conns[i];
+	if(tcp_open(conn, fd, server) < 0){
+		return -1;
+	}
+	conn->connecting = connecting;
+	conn->want_write = connecting;
+	conn->last_active = now_ms();
+
+	struct epoll_event event;
+	event.events = connecting ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	event.data.u32 = CONN_EVENT + i;
+	if(epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0){
+		tcp_close(conn);
+		return -1;
+	}
+	return i;
+}
+
+/**
+ Finds a TCP connection to an upstream server to send a query down.
+ Connections are reused and queries pipelined on them, a new one is only opened
+ when the ones we have are busy and there are fewer than TCP_POOL.
+ returns the connection, or -1 if we couldnt get one.
+*/
+int upstream_conn(worker_t *worker, struct sockaddr_in *addr){
+	int best = -1;
+	int count = 0;
+	for(int i = 0; i < MAX_CONNS; i++){
+		dns_tcp_conn_t *conn = &worker->conns[i];
+		if(conn->fd < 0 || !conn->upstream || conn->server.sin_addr.s_addr != addr->sin_addr.s_addr
+				|| conn->server.sin_port != addr->sin_port){
+			continue;
+		}
+		count++;
+		if(best < 0 || conn->outstanding < worker->conns[best].outstanding){
+			best = i;
+		}
+	}
+	if(best >= 0 && (worker->conns[best].outstanding < TCP_PIPELINE || count >= TCP_POOL)){
+		return best;
+	}
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	if(fd < 0){
+		return best;
+	}
+	if(connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS){
+		close(fd);
+		return best;
+	}
+	int i = add_conn(worker, fd, addr, true);
+	return i >= 0 ? i : best;
+}
+
+/**
+ Turns an answer that is too big for UDP into an empty one with TC set, so the client asks again over TCP.
+ out must have room for the header and question, and an OPT record if edns is set.
+ returns the length of the truncated answer.
+*/
+int truncate_reply(char *message, char *out, bool edns){
+	int question_length = domainname_length(message + 12) + 4;
+	memcpy(out, message, 12 + question_length);
+	out[2] |= 0x02; // TC
+	uint16_t *counts = (uint16_t *)(out + 4);
+	counts[0] = htons(1); // QDCount
+	counts[1] = 0;
+	counts[2] = 0;
+	counts[3] = 0;
+	if(edns){
+		return append_opt(out, 12 + question_length, EDNS_SIZE, EDNS_SIZE);
+	}
+	return 12 + question_length;
+}
+
+/**
+ Sends a reply to a client with its QID put in, over UDP or down its TCP connection.
+ Replies bigger than the client said it can take over UDP are truncated. If the TCP connection has gone, the reply is dropped.
+*/
+void send_reply(worker_t *worker, dns_client_t *client, uint16_t qid, char *message, int length){
+	if(client->conn < 0){
+		char *reply = reply_buffer(worker);
+		if(length <= (client->edns ? client->edns : UDP_SIZE)){
+			memcpy(reply, message, length);
+		}else{
+			length = truncate_reply(message, reply, client->edns != 0);
+		}
+		((uint16_t *)reply)[0] = htons(qid);
+		queue_reply(worker, length, (struct sockaddr *)&client->addr, client->addr_length);
+		return;
+	}
+
+	dns_tcp_conn_t *conn = &worker->conns[client->conn];
+	if(conn->fd < 0 || conn->generation != client->generation){
+		return; // they hung up.
+	}
+	char *reply = tcp_queue(conn, message, length);
+	if(reply == NULL){
+		tcp_close(conn); // they arent reading what we send.
+		return;
+	}
+	((uint16_t *)reply)[0] = htons(qid);
+	conn->last_active = now_ms();
+	flush_conn(worker, client->conn);
+}
+
+/**
+ Sends an answer to a client that was waiting on a pending query, and counts it off its TCP connection.
+*/
+void reply_waiter(worker_t *worker, dns_waiter_t *waiter, char *message, int length){
+	if(waiter->client.conn >= 0){
+		dns_tcp_conn_t *conn = &worker->conns[waiter->client.conn];
+		if(conn->fd >= 0 && conn->generation == waiter->client.generation){
+			conn->waiting--;
+		}
+	}
+	send_reply(worker, &waiter->client, waiter->qid, message, length);
+}
+
+/**
+ Returns the address of one of a pending query's servers: an upstream server when forwarding,
+ or one of the servers of the zone it has got to when resolving iteratively.
+*/
+struct sockaddr_in *server_addr(worker_t *worker, dns_pending_t *pending, int server){
+	return iterative ? &pending->servers[server] : &worker->upstreams[server].addr;
+}
+
+/**
+ Finds which of a pending query's servers an answer came from, see server_addr.
+ returns -1 if it isnt one of them.
+*/
+int find_server(worker_t *worker, dns_pending_t *pending, struct sockaddr_in *from){
+	if(!iterative){
+		return upstream_find(worker->upstreams, upstream_no, (struct sockaddr *)from);
+	}
+	for(int i = 0; i < pending->server_no; i++){
+		if(pending->servers[i].sin_addr.s_addr == from->sin_addr.s_addr && pending->servers[i].sin_port == from->sin_port){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ returns how long to wait on an answer from one of a pending query's servers.
+*/
+uint64_t server_timeout(worker_t *worker, int server){
+	return iterative ? ITERATIVE_TIMEOUT : (uint64_t)upstream_timeout(&worker->upstreams[server]);
+}
+
+/**
+ Sends a pending query to its server, from its upstream socket or over TCP if the UDP answer was truncated.
+ The query is rebuilt from the question, so retries look just like the first attempt.
+ It advertises EDNS_SIZE with EDNS0, unless the server has shown it doesnt understand it.
+*/
+void send_query(worker_t *worker, dns_pending_t *pending){
+	dns_question_t question = {pending->qname, pending->qtype, pending->qclass};
+	dns_question_t *questions[1] = {&question};
+	dns_resource_record_t opt;
+	dns_resource_record_t *additional[1] = {&opt};
+	init_opt(&opt, EDNS_SIZE, 0);
+
+	dns_packet_t query;
+	memset(&query.header, 0, sizeof(query.header));
+	query.header.QID = pending->qid;
+	query.header.RD = !iterative; // the zone's servers only have to tell us what they know.
+	query.header.QDCount = 1;
+	query.header.ARCount = pending->no_edns ? 0 : 1;
+	query.questions = questions;
+	query.additional = additional;
+
+	char buf[UDP_SIZE];
+	int length = write_packet(&query, buf, sizeof(buf));
+	if(length < 0){
+		return;
+	}
+
+	if(pending->tcp){
+		int i = upstream_conn(worker, server_addr(worker, pending, pending->server));
+		if(i < 0){
+			return; // the timer will try again.
+		}
+		dns_tcp_conn_t *conn = &worker->conns[i];
+		if(tcp_queue(conn, buf, length) == NULL){
+			return;
+		}
+		conn->outstanding++;
+		conn->last_active = now_ms();
+		flush_conn(worker, i);
+		return;
+	}
+
+	struct sockaddr_in *server = server_addr(worker, pending, pending->server);
+	if(sendto(worker->upstream_sds[pending->upstream], buf, length, 0, (struct sockaddr *)server, sizeof(*server)) < 0){
+		printf("Failed to send\n");
+	}
+}
+
+/**
+ Sends a pending query to the best server it hasnt been tried on yet, and sets the timer for it.
+ A zone's servers are all as good as each other, so the query just goes round them from a random one.
+ Each attempt waits twice as long as the one before, but never past the query's deadline, or STALE_TIMEOUT before that.
+*/
+void attempt_query(worker_t *worker, dns_pending_t *pending, uint64_t now){
+	if(iterative){
+		int server = random_qid() % pending->server_no;
+		for(int i = 0; i < pending->server_no && (pending->tried & (1u << server)); i++){
+			server = (server + 1) % pending->server_no;
+		}
+		pending->server = server;
+	}else{
+		pending->server = upstream_pick(worker->upstreams, upstream_no, pending->tried, now);
+	}
+	pending->tried |= 1u << pending->server;
+	pending->attempts++;
+	pending->last_sent = now;
+
+	uint64_t timeout = server_timeout(worker, pending->server) << (pending->attempts - 1);
+	uint64_t deadline = pending->started + QUERY_DEADLINE;
+	if(now < pending->started + STALE_TIMEOUT){
+		deadline = pending->started + STALE_TIMEOUT; // so its clients get stale records on time, see serve_stale.
+	}
+	pending_set_timer(&worker->pending_table, pending, now + timeout < deadline ? now + timeout : deadline);
+	send_query(worker, pending);
+}
+
+void iterate_query(worker_t *worker, dns_pending_t *pending, uint64_t now);
+
+/**
+ Removes a pending query that has been answered or given up on,
+ and lets the queries that were waiting on it go on from what is in the cache now.
+*/
+void finish_query(worker_t *worker, dns_pending_t *pending){
+	// they are found again afterwards, removing this one can move them.
+	uint32_t hashes[MAX_DEPENDENTS];
+	uint16_t qids[MAX_DEPENDENTS];
+	int dependent_no = 0;
+	for(int w = pending->waiters; w >= 0; w = worker->pending_table.waiters[w].next){
+		dns_waiter_t *waiter = &worker->pending_table.waiters[w];
+		if(waiter->dependent && dependent_no < MAX_DEPENDENTS){
+			hashes[dependent_no] = waiter->hash;
+			qids[dependent_no++] = waiter->qid;
+		}
+	}
+	pending_remove(&worker->pending_table, pending);
+
+	uint64_t now = now_ms();
+	for(int i = 0; i < dependent_no; i++){
+		dns_pending_t *dependent = pending_find_id(&worker->pending_table, hashes[i], qids[i]);
+		if(dependent != NULL){
+			iterate_query(worker, dependent, now);
+		}
+	}
+}
+
+/**
+ Asks the server that just answered a pending query again, after changing how it is asked
+ (over TCP, or without EDNS0). This doesnt count as another attempt.
+*/
+void resend_query(worker_t *worker, dns_pending_t *pending, int server, uint64_t now){
+	pending->server = server;
+	pending->last_sent = now;
+	uint64_t deadline = pending->started + QUERY_DEADLINE;
+	uint64_t timeout = now + 2 * server_timeout(worker, server);
+	pending_set_timer(&worker->pending_table, pending, timeout < deadline ? timeout : deadline);
+	send_query(worker, pending);
+}
+
+/**
+ Answers a pending query's question from the cache, as a client asking it plainly would get it.
+ With stale set, records that ran out less than STALE_WINDOW ago can be used too (RFC 8767).
+ returns the length of the answer written into out (n bytes long), 0 if the cache cant answer.
+*/
+int cached_answer(worker_t *worker, dns_pending_t *pending, char *out, int n, bool stale){
+	dns_question_t question = {pending->qname, pending->qtype, pending->qclass};
+	dns_question_t *questions[1] = {&question};
+	dns_packet_t request;
+	memset(&request.header, 0, sizeof(request.header));
+	request.header.RD = 1;
+	request.header.QDCount = 1;
+	request.questions = questions;
+	request.opt = NULL;
+	return answer_from_cache(&request, out, n, &worker->responses, stale, NULL);
+}
+
+/**
+ Sends an answer to the clients waiting on a pending query, with their own QID put back.
+ message mustnt have an OPT record, clients that used EDNS0 get ours put on.
+*/
+void send_answer(worker_t *worker, dns_pending_t *pending, char *message, int length){
+	char *edns_message = worker->scratch;
+	memcpy(edns_message, message, length);
+	int edns_length = append_opt(edns_message, length, sizeof(worker->scratch), EDNS_SIZE);
+
+	for(int w = pending->waiters; w >= 0; w = worker->pending_table.waiters[w].next){
+		dns_waiter_t *waiter = &worker->pending_table.waiters[w];
+		if(waiter->dependent){
+			continue;
+		}
+		if(waiter->client.edns && edns_length > 0){
+			reply_waiter(worker, waiter, edns_message, edns_length);
+		}else{
+			reply_waiter(worker, waiter, message, length); // send to requester.
+		}
+	}
+}
+
+/**
+ Sends an answer to everyone waiting on a pending query, and finishes it.
+*/
+void deliver_answer(worker_t *worker, dns_pending_t *pending, char *message, int length){
+	send_answer(worker, pending, message, length);
+	finish_query(worker, pending);
+}
+
+/**
+ Answers everyone waiting on a pending query with stale records from the cache, if it has any, and finishes it.
+ returns false if there werent any.
+*/
+bool deliver_stale(worker_t *worker, dns_pending_t *pending){
+	char answer[EDNS_SIZE];
+	int length = cached_answer(worker, pending, answer, sizeof(answer), true);
+	if(length <= 0){
+		return false;
+	}
+	deliver_answer(worker, pending, answer, length);
+	return true;
+}
+
+/**
+ Answers the clients waiting on a slow pending query with stale records from the cache, if it has any.
+ The query carries on without them, to refresh the records.
+*/
+void serve_stale(worker_t *worker, dns_pending_t *pending){
+	char answer[EDNS_SIZE];
+	if(pending->waiter_count == 0){
+		return;
+	}
+	int length = cached_answer(worker, pending, answer, sizeof(answer), true);
+	if(length > 0){
+		send_answer(worker, pending, answer, length);
+		pending_release_clients(&worker->pending_table, pending);
+	}
+}
+
+/**
+ Gives up on a pending query, everyone waiting on it gets a SERVFAIL, or stale records if the cache still has them.
+ Queries waiting on it go on, and most likely give up too.
+*/
+void fail_query(worker_t *worker, dns_pending_t *pending){
+	if(deliver_stale(worker, pending)){
+		return;
+	}
+
+	dns_question_t question = {pending->qname, pending->qtype, pending->qclass};
+	dns_question_t *questions[1] = {&question};
+	dns_resource_record_t opt; // only there to say the client used EDNS0.
+	dns_packet_t request;
+	memset(&request.header, 0, sizeof(request.header));
+	request.header.RD = 1;
+	request.header.QDCount = 1;
+	request.questions = questions;
+
+	char response[UDP_SIZE];
+	for(int w = pending->waiters; w >= 0; w = worker->pending_table.waiters[w].next){
+		dns_waiter_t *waiter = &worker->pending_table.waiters[w];
+		if(waiter->dependent){
+			continue;
+		}
+		request.opt = waiter->client.edns ? &opt : NULL;
+		int length = write_error(&request, 2, response, sizeof(response)); // SERVFAIL
+		if(length > 0){
+			reply_waiter(worker, waiter, response, length);
+		}
+	}
+	finish_query(worker, pending);
+}
+
+/**
+ Adds a pending query for a question, with our own QID so clients cant collide with each other and answers cant be guessed.
+ returns NULL if there are too many pending already.
+*/
+dns_pending_t *new_query(worker_t *worker, dns_question_t *question, uint64_t now){
+	dns_pending_t *pending = pending_add(&worker->pending_table, random_qid(), question);
+	if(pending != NULL){
+		pending->upstream = random_qid() % UPSTREAM_SOCKETS;
+		pending->tried = 0;
+		pending->attempts = 0;
+		pending->started = now;
+	}
+	return pending;
+}
+
+/**
+ Makes a pending query wait on the answer to another question, asking it if nobody has yet.
+ With refresh set, the other question is asked of its zone even if the cache has an answer to it.
+ When that is answered, or given up on, the query goes on with iterate_query.
+ Pending queries can move when others are added or removed, so pending mustnt be used after this.
+*/
+void await_query(worker_t *worker, dns_pending_t *pending, dns_question_t *question, bool refresh, uint64_t now){
+	dns_pending_table_t *table = &worker->pending_table;
+	dns_pending_t *other = pending_find(table, question);
+	bool start = other == NULL;
+	if(start){
+		other = new_query(worker, question, now);
+		if(other != NULL){
+			other->refresh = refresh;
+		}
+	}
+	if(other != NULL && other != pending && pending_add_dependent(table, other, pending) == 0){
+		pending->server_no = 0; // late answers from the last zone's servers are no use to it now.
+		pending_set_timer(table, pending, pending->started + QUERY_DEADLINE);
+		if(start){
+			iterate_query(worker, other, now);
+		}
+		return;
+	}
+
+	uint32_t hash = pending->hash;
+	uint16_t qid = pending->qid;
+	if(start && other != NULL){
+		pending_remove(table, other); // nobody to answer.
+	}
+	fail_query(worker, pending_find_id(table, hash, qid));
+}
+
+/**
+ Takes an iterative query a step further, from what the cache knows now.
+ If the cache has the answer everyone waiting gets that. Otherwise it goes to the servers of the closest zone we know of,
+ or waits on the address of one of them if we dont know any.
+ Like await_query, pending mustnt be used after this.
+*/
+void iterate_query(worker_t *worker, dns_pending_t *pending, uint64_t now){
+	if(++pending->steps > MAX_STEPS || now >= pending->started + QUERY_DEADLINE){
+		fail_query(worker, pending); // going round in circles.
+		return;
+	}
+
+	// a refresh has to get the answer from the zone, the cache still has the old one.
+	char answer[EDNS_SIZE];
+	int length = pending->refresh ? 0 : cached_answer(worker, pending, answer, sizeof(answer), false);
+	if(length > 0){
+		deliver_answer(worker, pending, answer, length);
+		return;
+	}
+
+	uint32_t addresses[ZONE_SERVERS];
+	char missing[255];
+	int count = find_servers(pending->qname, pending->zone, addresses, ZONE_SERVERS, missing);
+	if(count > 0 && pending->zone[0] == 0 && upstream_no > 0){
+		count = upstream_no < ZONE_SERVERS ? upstream_no : ZONE_SERVERS;
+		for(int i = 0; i < count; i++){
+			pending->servers[i] = upstream_list[i].addr;
+		}
+	}else{
+		for(int i = 0; i < count; i++){
+			memset(&pending->servers[i], 0, sizeof(pending->servers[i]));
+			pending->servers[i].sin_family = AF_INET;
+			pending->servers[i].sin_port = htons(DNS_PORT);
+			pending->servers[i].sin_addr.s_addr = addresses[i];
+		}
+	}
+	pending->server_no = count;
+	pending->tried = 0;
+	pending->attempts = 0;
+	pending->tcp = false;
+	if(count > 0){
+		attempt_query(worker, pending, now);
+		return;
+	}
+	if(missing[0] != 0){
+		dns_question_t lookup = {missing, T_A, C_IN};
+		await_query(worker, pending, &lookup, false, now);
+		return;
+	}
+	fail_query(worker, pending);
+}
+
+/**
+ Sends a new pending query on its way, upstream or to the closest zone's servers.
+*/
+void start_query(worker_t *worker, dns_pending_t *pending){
+	if(iterative){
+		iterate_query(worker, pending, pending->started);
+	}else{
+		attempt_query(worker, pending, pending->started);
+	}
+}
+
+/**
+ Asks a question again before the cached answer to it runs out, so clients asking it dont have to wait when it does.
+ Nobody waits on the query, its answer just goes in the cache. Unless it is already being asked.
+*/
+void refresh_query(worker_t *worker, dns_question_t *question){
+	if(pending_find(&worker->pending_table, question) != NULL){
+		return;
+	}
+	dns_pending_t *pending = new_query(worker, question, now_ms());
+	if(pending != NULL){
+		pending->refresh = true;
+		start_query(worker, pending);
+	}
+}
+
+/**
+ Checks whether an answer from a zone's server sends us on to the servers of a zone further down:
+ no answer and not authoritative, just their NS records.
+*/
+bool is_referral(dns_packet_t *response){
+	if(response->header.RCode != 0 || response->header.AA || response->header.ANCount > 0){
+		return false;
+	}
+	for(int i = 0; i < response->header.NSCount; i++){
+		if(response->authorities[i]->Type == T_NS){
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ Follows the CNAMEs in an answer from the name asked about. If they lead to a name the answer says nothing more about,
+ the rest of the chain has to be looked up before the answer is complete (the target is likely in another zone).
+ returns the name the chain stops at, or NULL if the answer is complete.
+*/
+char *unfinished_chain(dns_packet_t *response){
+	dns_question_t *question = response->questions[0];
+	if(response->header.RCode != 0 || question->QType == T_CNAME || question->QType == QT_ALL){
+		return NULL;
+	}
+	char *name = question->QName;
+	bool followed = false;
+	for(int hops = 0; hops <= response->header.ANCount; hops++){
+		char *next = NULL;
+		for(int i = 0; i < response->header.ANCount; i++){
+			dns_resource_record_t *rr = response->answers[i];
+			if(!name_equal(rr->Name, name)){
+				continue;
+			}
+			if(rr->Type == question->QType){
+				return NULL;
+			}
+			if(rr->Type == T_CNAME){
+				next = rr->RData;
+			}
+		}
+		if(next == NULL){
+			break;
+		}
+		name = next;
+		followed = true;
+	}
+	for(int i = 0; i < response->header.NSCount; i++){
+		if(response->authorities[i]->Type == T_SOA){
+			return NULL; // the target has nothing of that type.
+		}
+	}
+	return followed ? name : NULL;
+}
+
+/**
+ Handles an answer from upstream server: caches it, and sends it to the clients whose query it answers.
+ from is the server it came from, and socket the upstream socket it came in on, -1 if it came over TCP.
+ A SERVFAIL or REFUSED from one server is retried on another, if there is one we havent tried.
+ A truncated answer is asked for again over TCP, and a FORMERR to our OPT record is asked again without it.
+ When resolving iteratively a referral sends the query on down, and a CNAME to another zone has its target looked up.
+*/
+int handle_response(worker_t *worker, char *message, int length, struct sockaddr_in *from, int socket, dns_arena_t *arena){
+	dns_packet_t *response = parse_packet(message, length, arena);
+	if(response == NULL || response->header.QDCount < 1){
+		return 0; // cant match it to anything.
+	}
+
+	dns_pending_t *pending = pending_find(&worker->pending_table, response->questions[0]);
+	if(pending == NULL || pending->qid != response->header.QID || (pending->tcp ? socket >= 0 : pending->upstream != socket)){
+		return 0; // late, not something we asked, or someone guessing.
+	}
+	int server = find_server(worker, pending, from);
+	if(server < 0 || !(pending->tried & (1u << server))){
+		return 0; // not from one of its servers.
+	}
+
+	uint64_t now = now_ms();
+	if(!iterative){
+		// only time the answer if it was only sent once, otherwise we cant tell which attempt it answers.
+		upstream_success(&worker->upstreams[server], pending->attempts == 1 && !pending->tcp ? (int)(now - pending->last_sent) : -1);
+	}
+
+	int rcode = response->header.RCode;
+	if(response->header.TC && !pending->tcp){
+		// ask the same server again over TCP, it clearly has the answer.
+		pending->tcp = true;
+		resend_query(worker, pending, server, now);
+		return 0;
+	}
+	if(rcode == 1 && response->opt == NULL && !pending->no_edns){ // FORMERR
+		// a server from before EDNS0, RFC 6891 says to try again without it.
+		pending->no_edns = true;
+		resend_query(worker, pending, server, now);
+		return 0;
+	}
+
+	uint32_t untried = ((1u << (iterative ? pending->server_no : upstream_no)) - 1) & ~pending->tried;
+	if((rcode == 2 || rcode == 5) && untried != 0 && pending->attempts < MAX_ATTEMPTS){ // SERVFAIL or REFUSED
+		attempt_query(worker, pending, now);
+		return 0;
+	}
+	if((rcode == 2 || rcode == 5) && deliver_stale(worker, pending)){
+		return 0; // every server failed us, what we had is better than nothing.
+	}
+
+	// only cache answers to queries we actually sent, and only what a zone's servers can speak for.
+	cache_all(response, iterative ? pending->zone : "");
+
+	if(iterative){
+		if(is_referral(response)){
+			iterate_query(worker, pending, now);
+			return 0;
+		}
+		char *target = unfinished_chain(response);
+		if(target != NULL){
+			// once the rest is in, the cache has all of the answer, refreshed or not.
+			dns_question_t rest = {target, pending->qtype, pending->qclass};
+			bool refresh = pending->refresh;
+			pending->refresh = false;
+			await_query(worker, pending, &rest, refresh, now);
+			return 0;
+		}
+		// its our answer now, not the zone's.
+		message[2] = (message[2] & ~0x04) | 0x01; // AA off, RD on
+		message[3] |= 0x80; // RA
+	}
+
+	// upstream's OPT was meant for us, clients that used EDNS0 get ours instead.
+	length = remove_opt(response, message, length);
+	// everyone waiting on it gets the same answer.
+	deliver_answer(worker, pending, message, length);
 	return 0;
 }
 
-void *listener_thread(void *arg){
-	//Offset used so we dont check the buffer for free spaces starting at the same point every time.
-	int buffer_offset = 0;
+/**
+ Handles a query from a client: answers it from our zones or the cache if we can, otherwise forwards it upstream.
+ If the same question is already upstream the client just waits on that answer too.
+*/
+int handle_query(worker_t *worker, char *message, int length, dns_client_t *client, dns_arena_t *arena){
+	// UDP replies are written straight into the batch, TCP ones are copied onto the connection.
+	bool udp = client->conn < 0;
+	char *response = udp ? reply_buffer(worker) : worker->scratch;
 
-	char buf[512];
-	while(1){
+	// the hottest names are answered with a copy, before the query is even parsed.
+	int copy_length = answer_from_responses(worker, message, length, client, response, udp ? EDNS_SIZE : TCP_MESSAGE_SIZE);
+	if(copy_length > 0){
+		if(udp){
+			queue_reply(worker, copy_length, (struct sockaddr *)&client->addr, client->addr_length);
+		}else{
+			send_reply(worker, client, ((uint8_t)message[0] << 8) | (uint8_t)message[1], response, copy_length);
+		}
+		return 0;
+	}
 
-		struct sockaddr_in *client_addr = malloc(sizeof(struct sockaddr_in));
-		unsigned int client_addr_len = sizeof(&client_addr);
-		size_t bytes = recvfrom(sd, buf, sizeof(buf), 0, (struct sockaddr *)client_addr, &client_addr_len);
-		if(bytes < 0){
-			printf("Failed to receive\n");
-			return NULL;
+	dns_packet_t *request = parse_packet(message, length, arena);
+	if(request != NULL){
+		int payload_size = edns_payload_size(request);
+		client->edns = payload_size > EDNS_SIZE ? EDNS_SIZE : payload_size;
+	}
+	int size = !udp ? TCP_MESSAGE_SIZE : client->edns ? client->edns : UDP_SIZE;
+	int response_length;
+	bool prefetch = false;
+	if(request != NULL && edns_version(request) > 0){
+		response_length = write_error(request, 16, response, size); // BADVERS, we only know version 0.
+	}else if((response_length = answer_from_zones(request, response, size)) == 0){
+		response_length = answer_from_cache(request, response, size, &worker->responses, false, &prefetch);
+	}
+
+	if(response_length == 0 && request != NULL && request->header.QDCount >= 1){
+		bool forward = false;
+		dns_pending_t *pending = pending_find(&worker->pending_table, request->questions[0]);
+		if(pending == NULL){
+			pending = new_query(worker, request->questions[0], now_ms());
+			forward = pending != NULL;
 		}
 
-//		printf("Received message from IP: %s and port: %i\n", inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
-		print_packet(parse_packet(buf,bytes));
-		
-		//now we poll semaphore
-		sem_wait(&empty);
-		pthread_mutex_lock(&messages_lock);
-		
-		for(int i = 0; i < BUFFER_SIZE; i ++){
-			int off = (buffer_offset + i) % BUFFER_SIZE;
-			if(message_buffer[off].used == false){
-				buffer_offset = off + 1;// next time start at next one.
-				message_buffer[off].used = true;
-				message_buffer[off].sa = (struct sockaddr *)client_addr;//to be freed later;
-				message_buffer[off].message_length = bytes;
-				memcpy(message_buffer[off].message, buf, bytes);
-				break;
+		int added = pending != NULL ? pending_add_waiter(&worker->pending_table, pending, request->header.QID, client) : -1;
+		if(added >= 0){
+			if(added == 0 && client->conn >= 0){
+				worker->conns[client->conn].waiting++;
+			}
+			if(forward){
+				start_query(worker, pending);
 			}
+			return 0; // its on its way.
 		}
-		pthread_mutex_unlock(&messages_lock);
-		sem_post(&full);
+		if(forward){
+			pending_remove(&worker->pending_table, pending); // nobody to answer.
+		}
+		// too many queries in flight, tell the client rather than leave it hanging.
+		response_length = write_error(request, 2, response, size); // SERVFAIL
+	}
+	if(response_length <= 0){
+		return 0; // not a query we can do anything with.
+	}
 
+	if(udp){
+		queue_reply(worker, response_length, (struct sockaddr *)&client->addr, client->addr_length);
+	}else{
+		send_reply(worker, client, request->header.QID, response, response_length);
+	}
+	if(prefetch){
+		refresh_query(worker, request->questions[0]);
 	}
+	return 0;
 }
 
-void *resolver_thread(void *arg){
-	int buffer_offset = 0; // mimics offset in listener so we can chase them.
+/**
+ Works out whether a UDP message is a query or an answer from upstream, and handles it.
+ returns -1 if sending failed.
+*/
+int handle_message(worker_t *worker, dns_message_t *message, dns_arena_t *arena){
+	// if it came in on an upstream socket its an answer we need to use to respond to a message
+	if(message->upstream >= 0){
+		if(message->sa.ss_family != AF_INET){
+			return 0; // not from one of our servers, ignore it.
+		}
+		return handle_response(worker, message->message, message->message_length, (struct sockaddr_in *)&message->sa, message->upstream, arena);
+	}
+	// if it comes from anyone else its a query
+	dns_client_t client;
+	memcpy(&client.addr, &message->sa, message->sa_length);
+	client.addr_length = message->sa_length;
+	client.conn = -1;
+	client.generation = 0;
+	client.edns = 0;
+	return handle_query(worker, message->message, message->message_length, &client, arena);
+}
+
+/**
+ Receives everything waiting on one of the worker's sockets, a batch per recvmmsg, and handles it.
+ upstream is which upstream socket to read, -1 for the client socket.
+ returns -1 if receiving failed.
+*/
+int receive_messages(worker_t *worker, int upstream, dns_arena_t *arena){
+	int fd = upstream < 0 ? worker->sd : worker->upstream_sds[upstream];
 	while(1){
+		for(int i = 0; i < BATCH_SIZE; i++){
+			worker->iovecs[i].iov_base = worker->messages[i].message;
+			worker->iovecs[i].iov_len = sizeof(worker->messages[i].message);
+			memset(&worker->headers[i].msg_hdr, 0, sizeof(worker->headers[i].msg_hdr));
+			worker->headers[i].msg_hdr.msg_name = &worker->messages[i].sa;
+			worker->headers[i].msg_hdr.msg_namelen = sizeof(worker->messages[i].sa);
+			worker->headers[i].msg_hdr.msg_iov = &worker->iovecs[i];
+			worker->headers[i].msg_hdr.msg_iovlen = 1;
+		}
+		int received = recvmmsg(fd, worker->headers, BATCH_SIZE, MSG_DONTWAIT, NULL);
+		if(received < 0){
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+				return 0;
+			}
+			printf("Failed to receive\n");
+			return -1;
+		}
 
-		sem_wait(&full);
-		pthread_mutex_lock(&messages_lock);
-
-		//only do one message per loop.
-		for(int i = 0; i < BUFFER_SIZE; i ++){
-			int off = (buffer_offset + i) % BUFFER_SIZE;
-			if(message_buffer[off].used == true){
-				buffer_offset = off + 1;// next time start at next one.
-
-				// if it comes from our resolver we need to use it to respond to a message
-				if(cmp_addr(message_buffer[off].sa, (struct sockaddr *)&dns_addr) == 0){
-					dns_packet_t *response = parse_packet(message_buffer[off].message, message_buffer[off].message_length);
-					cache_all(response);
-
-					pthread_mutex_lock(&requests_lock);
-					for(int j = 0; j < BUFFER_SIZE; j++){
-						if(request_buffer[j].used == true){
-							//check each request for the valid QID.
-							dns_packet_t *request = parse_packet(request_buffer[j].message, request_buffer[j].message_length);
-							if(request->header.QID == response->header.QID){
-								size_t sent_bytes = sendto(sd,
-												message_buffer[off].message,
-												message_buffer[off].message_length,
-												0, request_buffer[j].sa, // send to requester.
-												sizeof(*request_buffer[j].sa));
-								if(sent_bytes < 0){
-									printf("Failed to send\n");
-									return NULL;
-							    }
-								//clear used bit in request
-								//and free both sa pointers.
-								request_buffer[j].used = false;
-								free(request_buffer[j].sa);
-								free(message_buffer[off].sa);
-								
-								break;
-							}
-						}
-					}
-					pthread_mutex_unlock(&requests_lock);
-				} else { // if it comes from anyone else its a query
-					pthread_mutex_lock(&requests_lock);
-					//TODO right now this loop will discard any request if there are 10 pending.
-					for(int j = 0; j < BUFFER_SIZE; j ++){
-						if(request_buffer[j].used == false){
-							// TODO can this be one copy?
-							request_buffer[j].used = true;
-							request_buffer[j].sa = message_buffer[off].sa;
-							request_buffer[j].message_length = message_buffer[off].message_length;
-							memcpy(request_buffer[j].message, message_buffer[off].message, message_buffer[off].message_length);
-
-							//FOrward query to resolver
-							size_t sent_bytes = sendto(sd,
-											message_buffer[off].message,
-											message_buffer[off].message_length,
-											0, (struct sockaddr *)&dns_addr,
-											sizeof(dns_addr));
-							if(sent_bytes < 0){
-								printf("Failed to send\n");
-								return NULL;
-							}
-
-							break;
-						}
-					}
-					pthread_mutex_unlock(&requests_lock);
-				}
-				//clear used bit since we've either moved it or used it to respond
-				message_buffer[off].used = false;
-				break;
+		for(int i = 0; i < received; i++){
+			dns_message_t *message = &worker->messages[i];
+			message->upstream = upstream;
+			message->sa_length = worker->headers[i].msg_hdr.msg_namelen;
+			message->message_length = worker->headers[i].msg_len;
+			arena_reset(arena);
+			if(handle_message(worker, message, arena) < 0){
+				return -1;
 			}
 		}
-		pthread_mutex_unlock(&messages_lock);
-		sem_post(&empty);
+		if(received < BATCH_SIZE){
+			return 0; // drained it.
+		}
 	}
 }
 
-int main(int argc, char **argv){
-	init_cache();
+/**
+ Accepts every client waiting on the TCP socket.
+*/
+void accept_conns(worker_t *worker){
+	while(1){
+		int fd = accept4(worker->tcp_sd, NULL, NULL, SOCK_NONBLOCK);
+		if(fd < 0){
+			return;
+		}
+		add_conn(worker, fd, NULL, false);
+	}
+}
 
-	// 0 out our buffer.
-	memset(request_buffer,0,BUFFER_SIZE * sizeof(dns_message_t));
-	sem_init(&empty, 0, BUFFER_SIZE);
-	sem_init(&full, 0, 0);
-	pthread_mutex_init(&messages_lock, NULL);
-	pthread_mutex_init(&requests_lock, NULL);
+/**
+ Handles a TCP connection being readable or writable.
+ Clients can send any number of queries without waiting, each is answered as soon as we have the answer,
+ which need not be in the order they were asked.
+*/
+void handle_conn(worker_t *worker, int i, uint32_t events, dns_arena_t *arena){
+	dns_tcp_conn_t *conn = &worker->conns[i];
+	if(conn->fd < 0){
+		return;
+	}
+	uint32_t generation = conn->generation;
 
-	struct sockaddr_in server_addr;
-	char buf[512];
+	if(conn->connecting){
+		int error = 0;
+		socklen_t error_length = sizeof(error);
+		getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+		if(error != 0 || (events & (EPOLLERR | EPOLLHUP))){
+			tcp_close(conn);
+			return;
+		}
+		if(!(events & EPOLLOUT)){
+			return;
+		}
+		conn->connecting = false;
+	}
+	if(events & EPOLLOUT){
+		flush_conn(worker, i);
+		if(conn->fd < 0){
+			return;
+		}
+	}
+	if(!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))){
+		return;
+	}
+
+	if(events & EPOLLHUP){
+		tcp_close(conn); // shut both ways, there is no one left to answer.
+		return;
+	}
+	int result = tcp_receive(conn);
+	conn->last_active = now_ms();
+	int offset = 0;
+	char *message;
+	int length;
+	while((length = tcp_message(conn, offset, &message)) >= 0){
+		offset += 2 + length;
+		arena_reset(arena);
+		if(conn->upstream){
+			conn->outstanding--;
+			handle_response(worker, message, length, &conn->server, -1, arena);
+		}else{
+			dns_client_t client;
+			client.addr_length = 0;
+			client.conn = i;
+			client.generation = generation;
+			client.edns = 0;
+			handle_query(worker, message, length, &client, arena);
+		}
+		if(conn->fd < 0 || conn->generation != generation){
+			return; // closed while answering.
+		}
+	}
+	tcp_consume(conn, offset);
+	if(result < 0 || (result > 0 && conn->upstream)){
+		tcp_close(conn);
+	}else if(result > 0){
+		// a client can shut its side once it has sent its queries, the answers still go back.
+		conn->read_closed = true;
+		flush_conn(worker, i);
+	}
+}
+
+/**
+ Loads the zones again off the event loop, as big ones take a while. Queries are answered from the old zones until
+ the new ones are in, and if one of them doesnt load the old ones stay.
+*/
+void *reload_thread(void *arg){
+	int loaded = load_zones();
+	if(loaded >= 0){
+		printf("reloaded %d zone records\n", loaded);
+	}else{
+		printf("zones not reloaded, still serving the old ones\n");
+	}
+	fflush(stdout);
+	__atomic_store_n(&reloading, false, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ Sweeps expired records out of the cache off the event loop, as it walks every record in it.
+*/
+void *sweep_thread(void *arg){
+	sweep_cache();
+	__atomic_store_n(&sweeping, false, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ Writes a snapshot of the cache off the event loop, as a big cache takes a while to write out.
+*/
+void *snapshot_thread(void *arg){
+	save_cache(snapshot_path);
+	__atomic_store_n(&snapshotting, false, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ Runs every TIMER_TICK ms: retries or gives up on queries whose timers have gone off,
+ closes idle TCP connections, and on the first worker has expired records swept out of the cache, the cache snapshotted and zones reloaded.
+*/
+void handle_tick(worker_t *worker){
+	uint64_t expirations;
+	read(worker->timer_fd, &expirations, sizeof(expirations));
+
+	// queries whose server didnt answer in time get another go, or a SERVFAIL once they are out of time.
+	uint64_t now = now_ms();
+	dns_pending_t *pending;
+	while((pending = pending_next_expired(&worker->pending_table, now)) != NULL){
+		if(!iterative){
+			upstream_failure(&worker->upstreams[pending->server], now);
+		}
+		if(pending->attempts >= MAX_ATTEMPTS || now >= pending->started + QUERY_DEADLINE){
+			fail_query(worker, pending);
+		}else{
+			if(now >= pending->started + STALE_TIMEOUT){
+				serve_stale(worker, pending);
+			}
+			attempt_query(worker, pending, now);
+		}
+	}
+
+	if(now >= worker->next_idle_check){
+		for(int i = 0; i < MAX_CONNS; i++){
+			dns_tcp_conn_t *conn = &worker->conns[i];
+			if(conn->fd >= 0 && now - conn->last_active > TCP_IDLE){ // queries give up well before this.
+				tcp_close(conn);
+			}
+		}
+		worker->next_idle_check = now + 1000;
+	}
+
+	if(worker->id == 0 && time(NULL) >= worker->next_sweep && !__atomic_load_n(&sweeping, __ATOMIC_ACQUIRE)){
+		worker->next_sweep = time(NULL) + SWEEP_INTERVAL;
+		pthread_t thread;
+		__atomic_store_n(&sweeping, true, __ATOMIC_RELEASE);
+		if(pthread_create(&thread, NULL, &sweep_thread, NULL) == 0){
+			pthread_detach(thread);
+		}else{
+			__atomic_store_n(&sweeping, false, __ATOMIC_RELEASE);
+		}
+	}
+	if(worker->id == 0 && stats_requested){
+		stats_requested = 0;
+		print_cache_stats();
+		fflush(stdout);
+	}
+	if(worker->id == 0 && reload_requested && !__atomic_load_n(&reloading, __ATOMIC_ACQUIRE)){
+		reload_requested = 0;
+		pthread_t thread;
+		__atomic_store_n(&reloading, true, __ATOMIC_RELEASE);
+		if(pthread_create(&thread, NULL, &reload_thread, NULL) == 0){
+			pthread_detach(thread);
+		}else{
+			__atomic_store_n(&reloading, false, __ATOMIC_RELEASE);
+		}
+	}
+	if(worker->id == 0 && snapshot_path != NULL && stop_requested){
+		// the last one is written here, after any still going, as nothing is left to answer once we exit.
+		while(__atomic_load_n(&snapshotting, __ATOMIC_ACQUIRE)){
+			usleep(1000);
+		}
+		save_cache(snapshot_path);
+		fflush(stdout);
+		exit(0);
+	}
+	if(worker->id == 0 && snapshot_path != NULL && time(NULL) >= worker->next_snapshot
+			&& !__atomic_load_n(&snapshotting, __ATOMIC_ACQUIRE)){
+		worker->next_snapshot = time(NULL) + SNAPSHOT_INTERVAL;
+		pthread_t thread;
+		__atomic_store_n(&snapshotting, true, __ATOMIC_RELEASE);
+		if(pthread_create(&thread, NULL, &snapshot_thread, NULL) == 0){
+			pthread_detach(thread);
+		}else{
+			__atomic_store_n(&snapshotting, false, __ATOMIC_RELEASE);
+		}
+	}
+}
 
-	memset(buf, 0, 512);
+/**
+ A worker's event loop. Waits on its client sockets, upstream sockets, TCP connections and timer,
+ and sends the UDP replies it has collected before it waits again.
+*/
+void *worker_thread(void *arg){
+	worker_t *worker = arg;
 
-	//Create Socket
-	sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	// parsed packets live here until the next message.
+	char arena_buf[ARENA_SIZE];
+	dns_arena_t arena;
+	arena_init(&arena, arena_buf, sizeof(arena_buf));
+
+	struct epoll_event events[BATCH_SIZE];
+	while(1){
+		// nothing from the cache is held between batches, so memory it retires can be freed while we wait.
+		cache_offline(worker->reader);
+		int n = epoll_wait(worker->epoll_fd, events, BATCH_SIZE, -1);
+		cache_quiescent(worker->reader);
+		if(n < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			printf("Failed to wait for events\n");
+			cache_offline(worker->reader);
+			return NULL;
+		}
+
+		for(int i = 0; i < n; i++){
+			uint32_t id = events[i].data.u32;
+			if(id == TIMER_EVENT){
+				handle_tick(worker);
+			}else if(id == TCP_LISTEN_EVENT){
+				accept_conns(worker);
+			}else if(id >= CONN_EVENT){
+				handle_conn(worker, id - CONN_EVENT, events[i].events, &arena);
+			}else if(receive_messages(worker, (int)id - 1, &arena) < 0){
+				cache_offline(worker->reader);
+				return NULL;
+			}
+		}
+		flush_replies(worker);
+	}
+}
 
-	if(sd < 0){
-		printf("error creating socket: %d\n", sd);
+/**
+ Opens a socket a worker takes client queries on, UDP or TCP (type is SOCK_DGRAM or SOCK_STREAM).
+ Every worker binds the same port, SO_REUSEPORT has the kernel hash clients across them.
+ returns the socket, or -1 on failure.
+*/
+int open_listen_socket(int type){
+	int s = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+	if(s < 0){
 		return -1;
 	}
 
 	// This lets us re-use the addr already in use by the local dns resolver
 	int optval = 1;
-	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
+	if(setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (const void *)&optval , sizeof(int))){
+		close(s);
+		return -1;
+	}
 
 	//Setup the server to listen on 53, any addr.
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(server_addr));
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_port = htons(DNS_PORT);
 	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	//Bind
-	if(bind(sd, (struct sockaddr *)&server_addr, sizeof(server_addr))){
+	if(bind(s, (struct sockaddr *)&server_addr, sizeof(server_addr))){
+		close(s);
+		return -1;
+	}
+	if(type == SOCK_STREAM && listen(s, SOMAXCONN)){
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/**
+ Sets up a worker's sockets, timer and tables and starts its thread on the given CPU.
+ returns -1 on failure.
+*/
+int start_worker(worker_t *worker, int id, int cpu){
+	worker->id = id;
+	worker->reader = cache_reader();
+	if(worker->reader < 0){
+		printf("too many workers\n");
+		return -1;
+	}
+	memcpy(worker->upstreams, upstream_list, sizeof(upstream_list));
+	if(pending_init(&worker->pending_table, PENDING_SIZE, WAITERS_SIZE, now_ms()) < 0){
+		printf("failed to allocate pending queries\n");
+		return -1;
+	}
+	if(responses_init(&worker->responses, RESPONSE_SLOTS) < 0){
+		printf("failed to allocate responses\n");
+		return -1;
+	}
+	worker->conns = calloc(MAX_CONNS, sizeof(dns_tcp_conn_t));
+	if(worker->conns == NULL){
+		printf("failed to allocate connections\n");
+		return -1;
+	}
+	for(int i = 0; i < MAX_CONNS; i++){
+		worker->conns[i].fd = -1;
+	}
+
+	worker->sd = open_listen_socket(SOCK_DGRAM);
+	if(worker->sd < 0){
 		perror(NULL);
 		printf("failed to bind\n");
-		close(sd);
 		return -1;
 	}
+	// a local resolver listening on TCP can keep us from binding, UDP still works without it.
+	worker->tcp_sd = open_listen_socket(SOCK_STREAM);
+	if(worker->tcp_sd < 0 && id == 0){
+		perror(NULL);
+		printf("failed to bind TCP, only serving UDP\n");
+	}
+	for(int i = 0; i < UPSTREAM_SOCKETS; i++){
+		worker->upstream_sds[i] = open_upstream_socket();
+		if(worker->upstream_sds[i] < 0){
+			perror(NULL);
+			printf("failed to open upstream socket\n");
+			return -1;
+		}
+	}
+
+	worker->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	struct itimerspec tick = {{0, TIMER_TICK * 1000000}, {0, TIMER_TICK * 1000000}};
+	if(worker->timer_fd < 0 || timerfd_settime(worker->timer_fd, 0, &tick, NULL) < 0){
+		perror(NULL);
+		printf("failed to create timer\n");
+		return -1;
+	}
+	worker->next_sweep = time(NULL) + SWEEP_INTERVAL;
+	worker->next_snapshot = time(NULL) + SNAPSHOT_INTERVAL;
+
+	worker->epoll_fd = epoll_create1(0);
+	if(worker->epoll_fd < 0){
+		perror(NULL);
+		printf("failed to create epoll\n");
+		return -1;
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	for(int i = 0; i < CONN_EVENT; i++){
+		int fd = i == 0 ? worker->sd
+			: i == TIMER_EVENT ? worker->timer_fd
+			: i == TCP_LISTEN_EVENT ? worker->tcp_sd
+			: worker->upstream_sds[i - 1];
+		if(fd < 0){
+			continue;
+		}
+		event.data.u32 = i;
+		if(epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0){
+			perror(NULL);
+			printf("failed to watch socket\n");
+			return -1;
+		}
+	}
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	int result = pthread_create(&worker->thread, NULL, &worker_thread, worker);
+	if(result != 0){
+		printf("failed to start worker thread: %s\n", strerror(result));
+		return -1;
+	}
+	pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
+	return 0;
+}
+
+/**
+ SIGUSR1 handler, asks for the cache's memory use to be printed. kill -USR1 to see it.
+*/
+void request_stats(int signal){
+	stats_requested = 1;
+}
+
+/**
+ SIGTERM and SIGINT handler when we keep snapshots, so the cache is saved before we exit.
+*/
+void request_stop(int signal){
+	stop_requested = 1;
+}
+
+/**
+ SIGHUP handler when we serve zones, so changed master files can be loaded without a restart.
+*/
+void request_reload(int signal){
+	reload_requested = 1;
+}
+
+int main(int argc, char **argv){
+	int cpu_no = sysconf(_SC_NPROCESSORS_ONLN);
+	worker_no = cpu_no;
+
+	int zone_no = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "w:u:is:z:")) != -1){
+		switch(opt){
+		case 'w':
+			worker_no = atoi(optarg);
+			break;
+		case 'u':
+			if(upstream_no == MAX_UPSTREAMS || upstream_parse(optarg, &upstream_list[upstream_no]) < 0){
+				printf("bad upstream server: %s\n", optarg);
+				return -1;
+			}
+			upstream_no++;
+			break;
+		case 'i':
+			iterative = true;
+			break;
+		case 's':
+			snapshot_path = optarg;
+			break;
+		case 'z':
+			if(zone_add(optarg) < 0){
+				printf("bad zone, it should be origin:file: %s\n", optarg);
+				return -1;
+			}
+			zone_no++;
+			break;
+		default:
+			printf("usage: %s [-w workers] [-u server[:port]]... [-i] [-s snapshot] [-z origin:zonefile]...\n", argv[0]);
+			return -1;
+		}
+	}
+	if(worker_no < 1){
+		worker_no = 1;
+	}
 
-	//setup the dns_server address.
-	dns_addr.sin_family = AF_INET;
-	dns_addr.sin_port = htons(DNS_PORT);
-	inet_pton(AF_INET, DNS_ADDRESS, &(dns_addr.sin_addr));
-	dns_struct_length = sizeof(dns_addr);
+	init_cache();
+	signal(SIGUSR1, request_stats);
+	if(snapshot_path != NULL){
+		int loaded = load_cache(snapshot_path);
+		if(loaded >= 0){
+			printf("loaded %d records from %s\n", loaded, snapshot_path);
+			fflush(stdout);
+		}
+		signal(SIGTERM, request_stop);
+		signal(SIGINT, request_stop);
+	}
 
-	//listen
+	if(zone_no > 0){
+		int loaded = load_zones();
+		if(loaded < 0){
+			return -1;
+		}
+		printf("loaded %d records from %d zones\n", loaded, zone_no);
+		fflush(stdout);
+		signal(SIGHUP, request_reload);
+	}
 
-	pthread_t resolver, listener;
+	//setup the dns_server address, if we werent given any and arent resolving ourselves.
+	if(upstream_no == 0 && !iterative){
+		upstream_parse(DNS_ADDRESS, &upstream_list[0]);
+		upstream_list[0].addr.sin_port = htons(DNS_PORT);
+		upstream_no = 1;
+	}
 
-	pthread_create(&resolver, NULL, &resolver_thread, NULL);
-	pthread_create(&listener, NULL, &listener_thread, NULL);
-	pthread_join(resolver, NULL);
+	//one worker per core by default.
+	workers = calloc(worker_no, sizeof(worker_t));
+	if(workers == NULL){
+		printf("failed to allocate workers\n");
+		return -1;
+	}
+	for(int i = 0; i < worker_no; i++){
+		if(start_worker(&workers[i], i, i % cpu_no) < 0){
+			return -1;
+		}
+	}
 
-	close(sd);
+	for(int i = 0; i < worker_no; i++){
+		pthread_join(workers[i].thread, NULL);
+	}
 	return 0;
 }
 
 /*
-Goal is one thread that listens to incoming packets and tosses them in a buffer.
-Another thread waits for data and then parses the data
-If its a question packet from a client, store ID and client and forward to dns server
+Each worker is one thread with an event loop over its own sockets, UDP and TCP.
+If its a question packet from a client, answer it from the cache, or store ID and client and forward to dns server
 If its an answer packet from the dns server, sned it back to corresponding client
 
 */
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include "slab.h"
+
+// Sizes of the classes, multiples of 16 so every object is aligned for anything it holds.
+// Closer together at the small end, where cached records and domains are.
+static const size_t class_sizes[SLAB_CLASSES] = {32, 48, 64, 80, 96, 112, 128, 160, 192, 256, 384, 512, 768, 1024};
+
+/**
+ Sets up a slab with all its classes empty.
+*/
+void slab_init(dns_slab_t *slab){
+	int class = 0;
+	for(int i = 0; i <= SLAB_MAX / 16; i++){
+		while(class_sizes[class] < (size_t)i * 16){
+			class++;
+		}
+		slab->class_of[i] = class;
+	}
+	for(int i = 0; i < SLAB_CLASSES; i++){
+		dns_slab_class_t *c = &slab->classes[i];
+		c->size = class_sizes[i];
+		c->free_list = NULL;
+		c->next = NULL;
+		c->end = NULL;
+		c->used = 0;
+		c->block_no = 0;
+	}
+	slab->large_bytes = 0;
+}
+
+/**
+ Allocates an object of at least size bytes, from the free list of its class if it can,
+ otherwise from the newest block, starting a new block when that is used up.
+ returns NULL on failure.
+*/
+void *slab_alloc(dns_slab_t *slab, size_t size){
+	if(size > SLAB_MAX){
+		void *object = malloc(size);
+		if(object != NULL){
+			slab->large_bytes += size;
+		}
+		return object;
+	}
+	dns_slab_class_t *c = &slab->classes[slab->class_of[(size + 15) / 16]];
+	void *object = c->free_list;
+	if(object != NULL){
+		c->free_list = *(void **)object;
+	}else{
+		if(c->next == NULL || c->next + c->size > c->end){
+			char *block = malloc(SLAB_BLOCK);
+			if(block == NULL){
+				return NULL;
+			}
+			c->next = block;
+			c->end = block + SLAB_BLOCK;
+			c->block_no++;
+		}
+		object = c->next;
+		c->next += c->size;
+	}
+	c->used++;
+	return object;
+}
+
+/**
+ Puts an object back on the free list of its class, size must be what it was allocated with.
+*/
+void slab_free(dns_slab_t *slab, void *object, size_t size){
+	if(size > SLAB_MAX){
+		free(object);
+		slab->large_bytes -= size;
+		return;
+	}
+	dns_slab_class_t *c = &slab->classes[slab->class_of[(size + 15) / 16]];
+	*(void **)object = c->free_list;
+	c->free_list = object;
+	c->used--;
+}
+
+/**
+ returns the bytes an object of the given size really takes, once it is rounded up to its class.
+*/
+size_t slab_size(dns_slab_t *slab, size_t size){
+	if(size > SLAB_MAX){
+		return size;
+	}
+	return slab->classes[slab->class_of[(size + 15) / 16]].size;
+}
+
+/**
+ returns the bytes the slab has taken from malloc, free objects and all.
+*/
+size_t slab_bytes(dns_slab_t *slab){
+	size_t bytes = slab->large_bytes;
+	for(int i = 0; i < SLAB_CLASSES; i++){
+		bytes += slab->classes[i].block_no * SLAB_BLOCK;
+	}
+	return bytes;
+}
@@ -0,0 +1,36 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+// Size classes the slab hands out, anything bigger than the last goes to malloc.
+#define SLAB_CLASSES 14
+#define SLAB_MAX 1024
+// Bytes carved into objects at a time for each class.
+#define SLAB_BLOCK (64 * 1024)
+
+// Objects of one size, cut out of blocks and kept on a free list once freed.
+// Blocks are never given back, freed objects are reused by the next allocation of the same class.
+typedef struct dns_slab_class{
+	size_t size;
+	void *free_list; // each free object holds a pointer to the next.
+	char *next; // the part of the newest block that hasnt been handed out yet.
+	char *end;
+	size_t used; // objects handed out and not freed.
+	size_t block_no;
+} dns_slab_class_t;
+
+// A set of size classes. Not thread safe, the owner has to lock around it.
+typedef struct dns_slab{
+	dns_slab_class_t classes[SLAB_CLASSES];
+	unsigned char class_of[SLAB_MAX / 16 + 1]; // size class for each 16 bytes of object size.
+	size_t large_bytes; // held by objects too big for a class.
+} dns_slab_t;
+
+void slab_init(dns_slab_t *);
+void *slab_alloc(dns_slab_t *, size_t);
+void slab_free(dns_slab_t *, void *, size_t);
+size_t slab_size(dns_slab_t *, size_t);
+size_t slab_bytes(dns_slab_t *);
+
+#endif
@@ -1,188 +1,1261 @@
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 #include "storage.h"
+#include "slab.h"
 
-#define CACHE_SIZE 1000
+// Bytes of memory the cache may use for records and domains before it starts evicting.
+#define CACHE_SIZE (64 * 1024 * 1024)
+// Records the sweeper looks at before giving the lock back to inserts.
+#define SWEEP_BATCH 1024
+// Longest we will hold on to a record, regardless of what its TTL says.
+#define MAX_TTL 604800
+// Longest we will hold on to a negative answer, as RFC 2308 suggests.
+#define MAX_NEGATIVE_TTL 10800
+// Seconds a record is kept after it runs out, to answer with if upstream cant be reached (RFC 8767).
+#define STALE_WINDOW 86400
+// TTL stale records are served with, RFC 8767 recommends 30 seconds.
+#define STALE_TTL 30
+// A record is due to be refreshed in the last 1/PREFETCH_FRACTION of its TTL,
+// and is refreshed before it runs out once it has gone in PREFETCH_HITS answers by then.
+#define PREFETCH_FRACTION 10
+#define PREFETCH_HITS 2
 
-dns_domain_t *create_domain(dns_domain_t *, char *);
+// Bytes each kind of object is allocated with, records carry their name and RData and domains their label.
+#define RECORD_SIZE(rr) (sizeof(dns_cache_record_t) + domainname_length((rr)->Name) + (rr)->RDLength)
+#define DOMAIN_SIZE(label) (sizeof(dns_domain_t) + (unsigned char)(label)[0] + 1)
+#define SET_SIZE(capacity) (sizeof(dns_record_set_t) + (capacity)*sizeof(dns_cache_record_t *))
+#define TABLE_SIZE(capacity) (sizeof(dns_domain_table_t) + (capacity)*sizeof(dns_domain_t *))
+// Smallest subdomain table a domain gets, tables are always a power of two.
+#define MIN_SUBDOMAINS 4
+// Smallest record set a domain gets.
+#define MIN_RECORDS 2
+// Most threads that can read the cache, see cache_reader.
+#define MAX_READERS 256
+// Generation counters domains are hashed over, a power of two.
+#define GENERATION_SLOTS 65536
+// Starts every cache snapshot, "DNSC" read as a little endian number. Snapshots in another byte order dont match.
+#define SNAPSHOT_MAGIC 0x43534E44
+// Bumped whenever the snapshot format changes, so an old file is ignored rather than misread.
+#define SNAPSHOT_VERSION 1
+
+int add_hint(dns_resource_record_t *);
+int store_record(char *, dns_resource_record_t *, uint32_t, uint8_t, uint16_t);
+bool same_rrset(dns_resource_record_t *, dns_resource_record_t *);
+int replace_rrset(dns_resource_record_t **, int);
+int place_record(char *, dns_resource_record_t *, uint32_t, time_t, uint8_t, uint16_t);
+dns_domain_t *make_domain(char *);
+dns_cache_record_t *copy_record(dns_resource_record_t *);
+void cache_negative(dns_packet_t *, char *);
+void remove_negatives(dns_domain_t *, uint16_t);
+bool name_under(char *, char *);
+int split_labels(char *, char **);
+uint32_t label_hash(char *);
+bool label_equal(char *, char *);
+dns_domain_t *find_subdomain(dns_domain_t *, char *, uint32_t);
+int add_subdomain(dns_domain_t *, dns_domain_t *);
+void remove_subdomain(dns_domain_t *, dns_domain_t *);
+dns_domain_t *create_domain(dns_domain_t *, char *, uint32_t);
+int append_record(dns_record_set_t **, dns_cache_record_t *);
+void drop_record(dns_record_set_t **, dns_cache_record_t *);
+void *cache_alloc(size_t);
+void cache_free(void *, size_t);
+void retire(void *, size_t);
+void reclaim();
+uint32_t generation_slot(dns_domain_t *);
+void domain_changed(dns_domain_t *);
+bool record_live(time_t, time_t, bool);
+int encode_records(dns_domain_t *, uint16_t, uint16_t, char *, dns_encoder_t *, int, dns_cache_record_t **, dns_answer_source_t *, bool);
+int encode_negative(dns_domain_t *, uint16_t, uint16_t, dns_encoder_t *, dns_answer_source_t *, bool);
+void note_record(dns_cache_record_t *, time_t, time_t, int, dns_answer_source_t *);
+int zone_addresses(dns_domain_t *, char *, uint32_t *, int, char *);
+void remove_record(dns_cache_record_t *);
+void prune_domain(dns_domain_t *);
+void evict_records();
+int write_record(FILE *, dns_cache_record_t *, time_t);
+int domain_name(dns_domain_t *, char *);
+bool name_valid(char *, int);
 void print_all(dns_domain_t *);
 
+// Addresses of the root servers, a to m, as in the root hints file.
+static const char *root_addresses[13] = {"198.41.0.4", "170.247.170.2", "192.33.4.12", "199.7.91.13", "192.203.230.10",
+	"192.5.5.241", "192.112.36.4", "198.97.190.53", "192.36.148.17", "192.58.128.30", "193.0.14.129", "199.7.83.42", "202.12.27.33"};
+
 // The super root is the root of the cache
 // It is one level below the root domain '.' to make tree traversal based on a string easier.
 dns_domain_t *super_root;
 
+// Guards the tree against other writers, along with the clock ring, the byte count and the retired list.
+// Lookups dont take it, so everything they read is published with a release store once it is ready,
+// and nothing they could still be holding is freed until they have all moved on, see retire.
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Every evictable record in the cache, the clock hand sweeps over these looking for a victim.
+dns_cache_record_t **clock_ring;
+int clock_size = 0;
+int clock_capacity = 0;
+int clock_hand = 0;
+
+// Everything in the cache is allocated from here, under cache_lock.
+dns_slab_t cache_slab;
+
+// Bytes currently held by the cache, as rounded up by the slab.
+size_t cache_bytes = 0;
+// Bytes of names and RData in the evictable records, the rest of what the cache holds is overhead.
+size_t payload_bytes = 0;
+int domain_count = 0;
+
+// Bumped whenever the records of a domain hashed to the slot change, so copies of answers made from them
+// can tell they are out of date without looking at the domain (which may be gone).
+uint32_t generations[GENERATION_SLOTS];
+
+// Each thread reading the cache announces the epoch it last saw while holding nothing from the cache.
+// One to a cache line, as each is written by its own thread on every pass of its event loop.
+typedef struct dns_reader{
+	uint64_t epoch; // 0 while the thread is waiting for events and holds nothing.
+} __attribute__((aligned(64))) dns_reader_t;
+
+dns_reader_t readers[MAX_READERS];
+int reader_no = 0;
+
+// Bumped after memory is taken out of the cache, readers that have seen the new value cant still be using it.
+uint64_t cache_epoch = 1;
+
+// Memory taken out of the cache that readers may still be using, in the order it was retired.
+typedef struct dns_retired{
+	void *ptr;
+	size_t size;
+	uint64_t epoch; // cache_epoch when it was retired.
+} dns_retired_t;
+
+dns_retired_t *retired;
+int retired_no = 0;
+int retired_capacity = 0;
+
+// Start of a cache snapshot, see save_cache. Everything in one is in the byte order of the host that wrote it,
+// they are for warm restarts on the same machine.
+typedef struct dns_snapshot_header{
+	uint32_t magic;
+	uint32_t version;
+	int64_t saved; // when it was written.
+} dns_snapshot_header_t;
+
+// A record in a snapshot. It is followed by the name of the domain it is cached under,
+// its own name if that isnt the same (a negative answer's SOA), and its RData.
+typedef struct dns_snapshot_record{
+	int64_t expires;
+	uint32_t ttl;
+	uint16_t type;
+	uint16_t class;
+	uint16_t rdlength;
+	uint16_t denied;
+	uint8_t negative;
+	uint8_t domain_length;
+	uint8_t name_length; // 0 if its name is the domain's.
+} __attribute__((packed)) dns_snapshot_record_t;
+
 /**
  initializes the DNS cache with root node. if fails, returns -1.
 */
 int init_cache(){
-	super_root = malloc(sizeof(dns_domain_t));
-	strcpy(super_root->label, "super_root");
-	super_root->domain_no = 1;
-	super_root->domains = malloc(sizeof(dns_domain_t *));
+	slab_init(&cache_slab);
+
+	super_root = cache_alloc(DOMAIN_SIZE("\x0a" "super_root"));
+	if(super_root == NULL){
+		return -1;
+	}
+	memcpy(super_root->label, "\x0a" "super_root", 11);
+	super_root->hash = label_hash(super_root->label);
+	super_root->parent = NULL;
+	super_root->ns_records = NULL;
+	super_root->records = NULL;
+	super_root->domain_no = 0;
+	super_root->domains = NULL;
 
 	dns_domain_t *root;
-	root = malloc(sizeof(dns_domain_t));
+	root = cache_alloc(DOMAIN_SIZE(""));
 	if(root == NULL){
 		return -1;
 	}
 
 	root->label[0] = '\0';
-	root->ns_record_no = 13;
-	root->ns_records = malloc(13*sizeof(dns_domain_t *));
-	if(root->ns_records == NULL){
+	root->hash = label_hash(root->label);
+	root->ns_records = NULL;
+	root->records = NULL;
+	root->domain_no = 0;
+	root->domains = NULL;
+	if(add_subdomain(super_root, root) < 0){
 		return -1;
 	}
+
+	// the root servers and their addresses, to start iterative resolution from.
 	for(int i = 0; i < 13; i ++){
-		root->ns_records[i] = malloc(sizeof(dns_resource_record_t));
-		if(root->ns_records[i] == NULL){
+		char server[20];
+		memcpy(server, "\x01" "a" "\x0c" "root-servers" "\x03" "net" "\x00", 20);
+		server[1] += i;
+		dns_resource_record_t ns = {"", T_NS, C_IN, 3600000, 20, server}; // TTL as in the root hints file
+		uint32_t address;
+		inet_pton(AF_INET, root_addresses[i], &address);
+		dns_resource_record_t a = {server, T_A, C_IN, 3600000, 4, &address};
+		if(add_hint(&ns) < 0 || add_hint(&a) < 0){
 			return -1;
 		}
-		root->ns_records[i]->Name[0] = '\0';
-		root->ns_records[i]->Class = C_IN;
-		root->ns_records[i]->Type = T_NS;
-		root->ns_records[i]->RDLength = 20;
-		root->ns_records[i]->RData = malloc(20*sizeof(char));
-		strncpy(root->ns_records[i]->RData, "\x01" "a" "\x0c" "root-servers" "\x03" "net" "\x00", 20);
-		((char *)root->ns_records[i]->RData)[1] +=i;
 	}
-	root->domain_no = 0;
-	super_root->domains[0] = root;
 //	print_domain(root);
 	return 0;
 }
 
 /**
- * Caches all of the RR in a particular packet.
+ Adds a record from the root hints, it never expires and is never evicted. Only for setting up the cache.
+ returns 0 on success, -1 on failure.
+*/
+int add_hint(dns_resource_record_t *rr){
+	dns_domain_t *domain = make_domain(rr->Name);
+	if(domain == NULL){
+		return -1;
+	}
+	dns_cache_record_t *record = copy_record(rr);
+	if(record == NULL){
+		return -1;
+	}
+	record->expires = 0;
+	record->domain = domain;
+	return append_record(rr->Type == T_NS ? &domain->ns_records : &domain->records, record);
+}
+
+/**
+ * Caches all of the RR in a particular packet, and the answer itself if it is a negative one.
+ * Only records at or below zone are kept, the rest arent the sender's to tell us about.
 */
-void cache_all(dns_packet_t *packet){
-	//TODO make this better, group domains before insertion.
-	for(int i = 0; i < packet->header.ANCount; i++){
-		insert_record(packet->answers[i]);
+void cache_all(dns_packet_t *packet, char *zone){
+	// an answer is the whole of each RRset in it, so it takes the place of what we had for them.
+	int answer_no = packet->header.ANCount;
+	dns_resource_record_t *rrset[answer_no > 0 ? answer_no : 1];
+	for(int i = 0; i < answer_no; i++){
+		dns_resource_record_t *rr = packet->answers[i];
+		bool seen = false;
+		for(int j = 0; j < i && !seen; j++){
+			seen = same_rrset(packet->answers[j], rr);
+		}
+		if(seen || !name_under(rr->Name, zone)){
+			continue;
+		}
+		int rr_no = 0;
+		for(int j = i; j < answer_no; j++){
+			if(same_rrset(packet->answers[j], rr)){
+				rrset[rr_no++] = packet->answers[j];
+			}
+		}
+		replace_rrset(rrset, rr_no);
 	}
 	for(int i = 0; i < packet->header.NSCount; i++){
-		insert_record(packet->authorities[i]);
+		if(name_under(packet->authorities[i]->Name, zone)){
+			insert_record(packet->authorities[i]);
+		}
 	}
 	for(int i = 0; i < packet->header.ARCount; i++){
 		if(packet->additional[i]->Type == T_OPT){
 			continue; // dont cache OPT pseudo records.
 		}
-		insert_record(packet->additional[i]);
+		if(name_under(packet->additional[i]->Name, zone)){
+			insert_record(packet->additional[i]);
+		}
+	}
+	cache_negative(packet, zone);
+}
+
+/**
+ Caches a negative answer (RFC 2308): an NXDOMAIN, or a NOERROR without any records of the type asked for.
+ It is kept as the SOA from the authority section, under the name at the end of any CNAME chain in the answer,
+ for the smaller of the SOA's TTL and its MINIMUM field. Without a SOA there is no telling how long it holds, so it isnt kept.
+*/
+void cache_negative(dns_packet_t *packet, char *zone){
+	int rcode = packet->header.RCode;
+	if(packet->header.QDCount != 1 || (rcode != 0 && rcode != 3)){
+		return;
+	}
+	dns_question_t *question = packet->questions[0];
+	if(question->QType == QT_ALL && rcode == 0){
+		return; // an empty answer to ANY doesnt deny any one type.
+	}
+
+	// follow the chain to the name the answer is really about.
+	char *name = question->QName;
+	for(int hops = 0; hops < MAX_CHAIN; hops++){
+		dns_resource_record_t *cname = NULL;
+		for(int i = 0; i < packet->header.ANCount; i++){
+			dns_resource_record_t *rr = packet->answers[i];
+			if(!name_equal(rr->Name, name)){
+				continue;
+			}
+			if(rr->Type == question->QType || question->QType == QT_ALL){
+				return; // not negative after all.
+			}
+			if(rr->Type == T_CNAME){
+				cname = rr;
+			}
+		}
+		if(cname == NULL){
+			break;
+		}
+		name = cname->RData;
+	}
+
+	for(int i = 0; i < packet->header.NSCount; i++){
+		dns_resource_record_t *soa = packet->authorities[i];
+		// two names, then serial, refresh, retry, expire and minimum.
+		if(soa->Type != T_SOA || soa->RDLength < 22 || !name_under(name, zone) || !name_under(soa->Name, zone)){
+			continue;
+		}
+		uint32_t minimum;
+		memcpy(&minimum, (char *)soa->RData + soa->RDLength - 4, 4);
+		minimum = ntohl(minimum);
+		uint32_t ttl = soa->TTL < minimum ? soa->TTL : minimum;
+		if(ttl > MAX_NEGATIVE_TTL){
+			ttl = MAX_NEGATIVE_TTL;
+		}
+		store_record(name, soa, ttl, rcode == 3 ? NXDOMAIN : NODATA, question->QType);
+		return;
+	}
+}
+
+/**
+ Checks whether two records are in the same RRset: the same name, type and class.
+*/
+bool same_rrset(dns_resource_record_t *a, dns_resource_record_t *b){
+	return a->Type == b->Type && a->Class == b->Class && name_equal(a->Name, b->Name);
+}
+
+/**
+ Caches an RRset in place of the one we had, so records that arent in it any more are taken out
+ rather than answered with alongside the new ones. Records that still are just have their TTL restarted.
+ returns 0 on success, -1 if not all of it could be cached.
+*/
+int replace_rrset(dns_resource_record_t **rrset, int rr_no){
+	dns_resource_record_t *first = rrset[0];
+	time_t now = time(NULL);
+	int result = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	dns_domain_t *domain = find_domain(first->Name);
+	dns_record_set_t **records = domain == NULL ? NULL : first->Type == T_NS ? &domain->ns_records : &domain->records;
+	int i = 0;
+	while(records != NULL && *records != NULL && i < (*records)->count){
+		dns_cache_record_t *cached = (*records)->records[i];
+		bool kept = cached->negative != POSITIVE || cached->expires == 0
+				|| cached->rr.Type != first->Type || cached->rr.Class != first->Class;
+		for(int j = 0; j < rr_no && !kept; j++){
+			kept = cached->rr.RDLength == rrset[j]->RDLength && memcmp(cached->rr.RData, rrset[j]->RData, rrset[j]->RDLength) == 0;
+		}
+		if(kept){
+			i++;
+		}else{
+			remove_record(cached); // the set is replaced, with the next record moved up to i.
+		}
+	}
+	for(int j = 0; j < rr_no; j++){
+		uint32_t ttl = rrset[j]->TTL;
+		if(ttl > 0 && place_record(rrset[j]->Name, rrset[j], ttl, now + (ttl < MAX_TTL ? ttl : MAX_TTL), POSITIVE, 0) < 0){
+			result = -1;
+		}
 	}
+	if(domain != NULL && result == 0){
+		prune_domain(domain); // if every record went and none came back. place_record prunes it itself when it fails.
+	}
+	reclaim();
+	pthread_mutex_unlock(&cache_lock);
+	return result;
 }
+
+/**
+ Inserts a copy of the record into the cache, under the domain for its name.
+ The record expires TTL seconds from now, inserting a record that is already cached just restarts its TTL.
+ If the cache is over budget afterwards, other records are evicted to make room.
+
+ returns 0 on success, -1 on failure.
+*/
 int insert_record(dns_resource_record_t *rr){
-	printf("NAME: %s\n", rr->Name);
-	dns_domain_t *current = super_root;
-	
-	char label[64];
-
-	int start = strlen(rr->Name);
-	int end = start;
-	while(start >= 0){
-		while(rr->Name[start] != '.' && start >= 0){
-			start--;
-		}
-		strncpy(label, rr->Name+start+1, end-start);
-		label[end-start-1] = '\0';
-		printf("%s\n", label);
-		end = start;
-		start--;
-
-		bool found = false;
-		for(int i = 0; i < current->domain_no; i++){
-			if(strcmp(current->domains[i]->label, label) == 0){
-				current = current->domains[i];
-				found = true;
-				break;
+	return store_record(rr->Name, rr, rr->TTL, POSITIVE, 0);
+}
+
+/**
+ Does the work of insert_record, for a record kept under the domain for name, ttl seconds from now.
+ negative and denied are as in dns_cache_record_t, a negative answer is stored as its SOA under the name it denies.
+ A positive record takes out the negative answers it proves wrong.
+
+ returns 0 on success, -1 on failure.
+*/
+int store_record(char *name, dns_resource_record_t *rr, uint32_t ttl, uint8_t negative, uint16_t denied){
+	if(ttl == 0){
+		return 0; // only good for the answer it came in
+	}
+	time_t expires = time(NULL) + (ttl < MAX_TTL ? ttl : MAX_TTL);
+
+	pthread_mutex_lock(&cache_lock);
+	int result = place_record(name, rr, ttl, expires, negative, denied);
+	reclaim();
+	//print_all(super_root);
+	pthread_mutex_unlock(&cache_lock);
+	return result;
+}
+
+/**
+ Puts a record in the cache for store_record, or for load_cache, running out at expires. Called with cache_lock held.
+ returns 0 on success, -1 on failure.
+*/
+int place_record(char *name, dns_resource_record_t *rr, uint32_t ttl, time_t expires, uint8_t negative, uint16_t denied){
+	// the TTL is what the prefetch window is worked out from, so it has to be capped like expires is.
+	if(ttl > MAX_TTL){
+		ttl = MAX_TTL;
+	}
+	if(negative != NODATA){
+		denied = 0;
+	}
+
+	dns_domain_t *current = make_domain(name);
+	if(current == NULL){
+		return -1;
+	}
+
+	if(negative == POSITIVE){
+		remove_negatives(current, rr->Type);
+	}
+	dns_record_set_t **records = rr->Type == T_NS && negative == POSITIVE ? &current->ns_records : &current->records;
+
+	// If we already have this record, just restart its TTL. The new TTL may not be the old one.
+	// rr is left as it is, readers copy it without a lock.
+	dns_record_set_t *set = *records;
+	for(int i = 0; set != NULL && i < set->count; i++){
+		dns_cache_record_t *cached = set->records[i];
+		if(cached->rr.Type == rr->Type && cached->rr.Class == rr->Class && cached->rr.RDLength == rr->RDLength
+				&& cached->negative == negative && cached->denied == denied
+				&& memcmp(cached->rr.RData, rr->RData, rr->RDLength) == 0){
+			if(cached->expires != 0){
+				__atomic_store_n(&cached->ttl, ttl, __ATOMIC_RELAXED);
+				__atomic_store_n(&cached->expires, expires, __ATOMIC_RELAXED);
+				__atomic_store_n(&cached->hits, 0, __ATOMIC_RELAXED);
 			}
+			return 0;
+		}
+	}
+
+	dns_cache_record_t *record = copy_record(rr);
+	if(record == NULL){
+		prune_domain(current);
+		return -1;
+	}
+	record->rr.TTL = ttl;
+	record->ttl = ttl;
+	record->expires = expires;
+	record->negative = negative;
+	record->denied = denied;
+	record->domain = current;
+
+	if(append_record(records, record) < 0){
+		cache_free(record, RECORD_SIZE(rr)); // never published, so no reader can have it.
+		prune_domain(current);
+		return -1;
+	}
+	domain_changed(current);
+
+	if(clock_size == clock_capacity){
+		int capacity = clock_capacity == 0 ? 1024 : clock_capacity*2;
+		dns_cache_record_t **ring = realloc(clock_ring, capacity*sizeof(dns_cache_record_t *));
+		if(ring == NULL){
+			remove_record(record);
+			prune_domain(current);
+			return -1;
 		}
-		if(!found){
-			current = create_domain(current, label);
+		clock_ring = ring;
+		clock_capacity = capacity;
+	}
+	record->clock_index = clock_size;
+	clock_ring[clock_size++] = record;
+
+	payload_bytes += domainname_length(rr->Name) + rr->RDLength;
+	evict_records();
+	return 0;
+}
+
+/**
+ Finds the domain for a name, making it and any of its parents that arent in the cache yet.
+ Called with cache_lock held. returns NULL on failure, with anything it made taken out again.
+*/
+dns_domain_t *make_domain(char *name){
+	dns_domain_t *current = super_root;
+
+	char *labels[128];
+	int label_no = split_labels(name, labels);
+	for(int i = 0; i < label_no; i++){
+		uint32_t hash = label_hash(labels[i]);
+		dns_domain_t *next = find_subdomain(current, labels[i], hash);
+		if(next != NULL){
+			current = next;
+		}else{
+			dns_domain_t *parent = current;
+			current = create_domain(parent, labels[i], hash);
 			if(current == NULL){
-				return -1; //failed to make the domain, cant go any further.
+				prune_domain(parent);
+				return NULL; //failed to make the domain, cant go any further.
 			}
 		}
 	}
-	if(rr->Type == T_NS){
-		current->ns_record_no += 1;
-		current->ns_records = realloc(current->ns_records, current->ns_record_no*sizeof(dns_resource_record_t *));
-		//TODO check if this fails.
+	return current;
+}
 
-		//TODO Make this a deep copy
-		current->ns_records[current->record_no-1] = rr;
-	}else{
-		current->record_no += 1;
-		current->records = realloc(current->records, current->record_no*sizeof(dns_resource_record_t *));
-		//TODO check if this fails.
+/**
+ Allocates a record for the cache and copies rr into it, with the name and RData in the same allocation, right after it.
+ The caller fills in when it expires and where it goes. returns NULL on failure.
+*/
+dns_cache_record_t *copy_record(dns_resource_record_t *rr){
+	int name_length = domainname_length(rr->Name);
+	dns_cache_record_t *record = cache_alloc(RECORD_SIZE(rr));
+	if(record == NULL){
+		return NULL;
+	}
+	record->rr = *rr;
+	record->rr.Name = (char *)(record + 1);
+	memcpy(record->rr.Name, rr->Name, name_length);
+	record->rr.RData = record->rr.Name + name_length;
+	memcpy(record->rr.RData, rr->RData, rr->RDLength);
+	record->referenced = false;
+	record->hits = 0;
+	record->ttl = rr->TTL;
+	record->negative = POSITIVE;
+	record->denied = 0;
+	record->clock_index = -1;
+	return record;
+}
+
+/**
+ Finds the labels of a wire format domain name, so the tree can be walked from the root down without copying them.
+ labels is filled with pointers to each length prefixed label, starting with the 0-length root label and ending with the first label of the name.
+ labels needs room for 128, the most a 255 byte name can have.
 
-		//TODO Make this a deep copy
-		current->records[current->record_no-1] = rr;
+ returns the number of labels.
+*/
+int split_labels(char *name, char **labels){
+	char *forward[128];
+	int label_no = 0;
+	while(*name != 0 && label_no < 127){
+		forward[label_no++] = name;
+		name += (unsigned char)*name + 1;
 	}
-	//print_all(super_root);
+	labels[0] = name; // the root label
+	for(int i = 0; i < label_no; i++){
+		labels[i+1] = forward[label_no-1-i];
+	}
+	return label_no + 1;
+}
+
+/**
+ Takes out the negative answers cached for a domain that a record of the given type proves wrong:
+ its NXDOMAIN, and any NODATA for that type. Called with cache_lock held.
+*/
+void remove_negatives(dns_domain_t *domain, uint16_t type){
+	dns_record_set_t *set = domain->records;
+	int i = 0;
+	while(set != NULL && i < set->count){
+		dns_cache_record_t *record = set->records[i];
+		if(record->negative == NXDOMAIN || (record->negative == NODATA && record->denied == type)){
+			remove_record(record); // the set is replaced, with the next record moved up to i.
+			set = domain->records;
+		}else{
+			i++;
+		}
+	}
+}
+
+/**
+ Compares two wire format names, ignoring case.
+*/
+bool name_equal(char *a, char *b){
+	while(*a != 0 && *b != 0){
+		if(!label_equal(a, b)){
+			return false;
+		}
+		a += (unsigned char)*a + 1;
+		b += (unsigned char)*b + 1;
+	}
+	return *a == *b;
+}
+
+/**
+ Checks whether a wire format name is zone or somewhere below it, ignoring case.
+*/
+bool name_under(char *name, char *zone){
+	if(*zone == 0){
+		return true; // everything is under the root.
+	}
+	int name_length = domainname_length(name);
+	int zone_length = domainname_length(zone);
+	while(name_length > zone_length){
+		name_length -= (unsigned char)*name + 1;
+		name += (unsigned char)*name + 1;
+	}
+	return name_length == zone_length && name_equal(name, zone);
+}
+
+/**
+ Lowercases the ASCII letters in 8 bytes at once.
+ For each byte the high bit of the sums is set when the low 7 bits are at least 'A', and when they are past 'Z'.
+ Only bytes with the first set and not the second (and no high bit of their own) get 0x20 added.
+*/
+static inline uint64_t fold_case(uint64_t word){
+	uint64_t low = word & 0x7F7F7F7F7F7F7F7FULL;
+	uint64_t at_least_a = low + 0x3F3F3F3F3F3F3F3FULL;
+	uint64_t past_z = low + 0x2525252525252525ULL;
+	uint64_t upper = (at_least_a ^ past_z) & ~word & 0x8080808080808080ULL;
+	return word | (upper >> 2);
+}
+
+/**
+ Hashes a length prefixed label for the subdomain tables, ignoring case.
+ FNV-1a over the label 8 bytes at a time, with the case folded out of each word.
+*/
+uint32_t label_hash(char *label){
+	int length = (unsigned char)label[0];
+	uint64_t hash = 14695981039346656037ULL ^ length;
+	label++;
+	while(length > 0){
+		uint64_t word = 0;
+		memcpy(&word, label, length < 8 ? length : 8);
+		hash = (hash ^ fold_case(word)) * 1099511628211ULL;
+		label += 8;
+		length -= 8;
+	}
+	return hash ^ (hash >> 32);
+}
+
+/**
+ Compares two length prefixed labels, ignoring case. (DNS names are case-insensitive)
+ Compares a word at a time, the last partial word is padded with zeros.
+*/
+bool label_equal(char *a, char *b){
+	int length = (unsigned char)a[0];
+	if(length != (unsigned char)b[0]){
+		return false;
+	}
+	a++;
+	b++;
+	while(length > 0){
+		uint64_t wa = 0, wb = 0;
+		int n = length < 8 ? length : 8;
+		memcpy(&wa, a, n);
+		memcpy(&wb, b, n);
+		if(fold_case(wa) != fold_case(wb)){
+			return false;
+		}
+		a += 8;
+		b += 8;
+		length -= 8;
+	}
+	return true;
+}
+
+/**
+ Finds the subdomain with the given label (and its label_hash) in the parent's table.
+ The table is open addressing with linear probing, so this stops at the first empty slot.
+ Safe without the lock, a subdomain being shifted back by remove_subdomain can be missed, which only means a trip upstream.
+ returns NULL if there is no such subdomain.
+*/
+dns_domain_t *find_subdomain(dns_domain_t *parent, char *label, uint32_t hash){
+	dns_domain_table_t *table = __atomic_load_n(&parent->domains, __ATOMIC_ACQUIRE);
+	if(table == NULL){
+		return NULL;
+	}
+	uint32_t mask = table->capacity - 1;
+	for(uint32_t i = hash & mask; ; i = (i + 1) & mask){
+		dns_domain_t *domain = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+		if(domain == NULL){
+			return NULL;
+		}
+		if(domain->hash == hash && label_equal(domain->label, label)){
+			return domain;
+		}
+	}
+}
+
+/**
+ Adds the domain to the parent's subdomain table, growing the table to keep it at most 3/4 full.
+ A bigger table is filled in before it replaces the old one, which is retired.
+ The domain must be ready for lookups, they can find it as soon as it is in the table.
+ returns 0 on success, -1 if the table could not grow.
+*/
+int add_subdomain(dns_domain_t *parent, dns_domain_t *domain){
+	dns_domain_table_t *table = parent->domains;
+	int old_capacity = table == NULL ? 0 : table->capacity;
+	if((parent->domain_no + 1) * 4 > old_capacity * 3){
+		int capacity = old_capacity == 0 ? MIN_SUBDOMAINS : old_capacity * 2;
+		dns_domain_table_t *grown = cache_alloc(TABLE_SIZE(capacity));
+		if(grown == NULL){
+			return -1;
+		}
+		grown->capacity = capacity;
+		memset(grown->slots, 0, capacity * sizeof(dns_domain_t *));
+		for(int i = 0; i < old_capacity; i++){
+			dns_domain_t *child = table->slots[i];
+			if(child == NULL){
+				continue;
+			}
+			uint32_t j = child->hash & (capacity - 1);
+			while(grown->slots[j] != NULL){
+				j = (j + 1) & (capacity - 1);
+			}
+			grown->slots[j] = child;
+		}
+		__atomic_store_n(&parent->domains, grown, __ATOMIC_RELEASE);
+		retire(table, TABLE_SIZE(old_capacity));
+		table = grown;
+	}
+
+	domain->parent = parent;
+	uint32_t mask = table->capacity - 1;
+	uint32_t i = domain->hash & mask;
+	while(table->slots[i] != NULL){
+		i = (i + 1) & mask;
+	}
+	__atomic_store_n(&table->slots[i], domain, __ATOMIC_RELEASE);
+	parent->domain_no += 1;
 	return 0;
 }
 
+/**
+ Takes the domain out of the parent's subdomain table.
+ Later entries in the probe run are shifted back into the hole, so no tombstones are needed.
+ Each is stored in the hole before its old slot is cleared, so lookups never see a subdomain that isnt there.
+*/
+void remove_subdomain(dns_domain_t *parent, dns_domain_t *domain){
+	dns_domain_table_t *table = parent->domains;
+	uint32_t mask = table->capacity - 1;
+	uint32_t hole = domain->hash & mask;
+	while(table->slots[hole] != domain){
+		if(table->slots[hole] == NULL){
+			return; // not here
+		}
+		hole = (hole + 1) & mask;
+	}
+	__atomic_store_n(&table->slots[hole], NULL, __ATOMIC_RELEASE);
+	parent->domain_no -= 1;
+
+	for(uint32_t i = (hole + 1) & mask; table->slots[i] != NULL; i = (i + 1) & mask){
+		uint32_t home = table->slots[i]->hash & mask;
+		// move it back if its home slot is not between the hole and where it sits now
+		if(((i - home) & mask) >= ((i - hole) & mask)){
+			__atomic_store_n(&table->slots[hole], table->slots[i], __ATOMIC_RELEASE);
+			__atomic_store_n(&table->slots[i], NULL, __ATOMIC_RELEASE);
+			hole = i;
+		}
+	}
+}
+
 /**
  Attempts to add a new subdomain with the given label to the parent domain.
  returns NULL on failure, otherwise returns a pointer to the new domain
   */
-dns_domain_t *create_domain(dns_domain_t *parent, char *label){
+dns_domain_t *create_domain(dns_domain_t *parent, char *label, uint32_t hash){
 
 	dns_domain_t *domain;
-	domain = malloc(sizeof(dns_domain_t));
+	domain = cache_alloc(DOMAIN_SIZE(label));
 	if(domain == NULL){
 		return NULL;
 	}
 
-	strncpy(domain->label, label, 64);
-	domain->ns_record_no = 0;
+	memcpy(domain->label, label, (unsigned char)label[0] + 1);
+	domain->hash = hash;
 	domain->ns_records = NULL;
-	domain->record_no = 0;
 	domain->records = NULL;
 	domain->domain_no = 0;
 	domain->domains = NULL;
 
-	parent->domain_no += 1;
-	parent->domains = realloc(parent->domains, parent->domain_no*sizeof(dns_domain_t *));
-	//TODO check if this fails.
-	parent->domains[parent->domain_no-1] = domain;
+	if(add_subdomain(parent, domain) < 0){
+		cache_free(domain, DOMAIN_SIZE(label));
+		return NULL;
+	}
 
+	domain_count++;
 	return domain;
 }
 
+/**
+ Adds a record to a record set. If the set has room the record goes in place and is counted once it is there,
+ otherwise the records are copied into a bigger set that replaces the old one, which is retired.
+ returns 0 on success, -1 if a bigger set couldnt be allocated.
+*/
+int append_record(dns_record_set_t **records, dns_cache_record_t *record){
+	dns_record_set_t *set = *records;
+	int count = set == NULL ? 0 : set->count;
+	if(set != NULL && count < set->capacity){
+		set->records[count] = record;
+		__atomic_store_n(&set->count, count + 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	int capacity = count == 0 ? MIN_RECORDS : count * 2;
+	dns_record_set_t *grown = cache_alloc(SET_SIZE(capacity));
+	if(grown == NULL){
+		return -1;
+	}
+	grown->count = count + 1;
+	grown->capacity = capacity;
+	if(count > 0){
+		memcpy(grown->records, set->records, count * sizeof(dns_cache_record_t *));
+	}
+	grown->records[count] = record;
+	__atomic_store_n(records, grown, __ATOMIC_RELEASE);
+	retire(set, set == NULL ? 0 : SET_SIZE(set->capacity));
+	return 0;
+}
+
+/**
+ Takes a record out of a record set, by replacing the set with a copy that doesnt have it.
+ The last record leaves the set NULL.
+*/
+void drop_record(dns_record_set_t **records, dns_cache_record_t *record){
+	dns_record_set_t *set = *records;
+	int i = 0;
+	while(i < set->count && set->records[i] != record){
+		i++;
+	}
+	if(i == set->count){
+		return; // not here
+	}
+
+	dns_record_set_t *shrunk = NULL;
+	if(set->count > 1){
+		shrunk = cache_alloc(SET_SIZE(set->capacity));
+		if(shrunk == NULL){
+			// fill the hole with the last record in place. a lookup racing with this can see that one twice,
+			// which is better than keeping a record that is about to be freed.
+			set->records[i] = set->records[set->count - 1];
+			__atomic_store_n(&set->count, set->count - 1, __ATOMIC_RELEASE);
+			return;
+		}
+		shrunk->count = set->count - 1;
+		shrunk->capacity = set->capacity;
+		memcpy(shrunk->records, set->records, i * sizeof(dns_cache_record_t *));
+		memcpy(shrunk->records + i, set->records + i + 1, (set->count - i - 1) * sizeof(dns_cache_record_t *));
+	}
+	__atomic_store_n(records, shrunk, __ATOMIC_RELEASE);
+	retire(set, SET_SIZE(set->capacity));
+}
+
+/**
+ Returns the generation slot a domain is counted in. Domains are hashed by address, so a domain freed
+ and another made in its place share a slot, but a domain is only freed once its records are gone
+ and taking them out bumped it.
+*/
+uint32_t generation_slot(dns_domain_t *domain){
+	uint64_t hash = (uintptr_t)domain * 0x9E3779B97F4A7C15ull;
+	return (hash >> 32) & (GENERATION_SLOTS - 1);
+}
+
+/**
+ Marks the records of a domain as changed, copies of answers made from them are out of date.
+ Called with the cache locked for writing.
+*/
+void domain_changed(dns_domain_t *domain){
+	__atomic_fetch_add(&generations[generation_slot(domain)], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ Returns the generation of a slot, see dns_answer_source_t.
+*/
+uint32_t cache_generation(uint32_t slot){
+	return __atomic_load_n(&generations[slot], __ATOMIC_ACQUIRE);
+}
+
+/**
+ Takes a record out of the cache and retires it.
+ Its domain is left in place even if it ends up empty, see prune_domain.
+*/
+void remove_record(dns_cache_record_t *record){
+	dns_domain_t *domain = record->domain;
+	drop_record(record->rr.Type == T_NS ? &domain->ns_records : &domain->records, record);
+	domain_changed(domain);
+
+	if(record->clock_index >= 0){
+		clock_size--;
+		clock_ring[record->clock_index] = clock_ring[clock_size];
+		clock_ring[record->clock_index]->clock_index = record->clock_index;
+		if(clock_hand >= clock_size){
+			clock_hand = 0;
+		}
+		payload_bytes -= domainname_length(record->rr.Name) + record->rr.RDLength;
+	}
+
+	retire(record, RECORD_SIZE(&record->rr));
+}
+
+/**
+ Retires the domain if it has no records and no subdomains left, then does the same for its parent.
+ The root domain is never pruned.
+*/
+void prune_domain(dns_domain_t *domain){
+	while(domain->parent != NULL && domain->parent != super_root){
+		if(domain->records != NULL || domain->ns_records != NULL || domain->domain_no > 0){
+			return;
+		}
+
+		dns_domain_t *parent = domain->parent;
+		remove_subdomain(parent, domain);
+
+		if(domain->domains != NULL){
+			retire(domain->domains, TABLE_SIZE(domain->domains->capacity));
+		}
+		retire(domain, DOMAIN_SIZE(domain->label));
+		domain_count--;
+
+		domain = parent;
+	}
+}
+
+/**
+ Evicts records until the cache is back under budget.
+ The clock hand gives every record that was hit since the hand last passed it a second chance.
+*/
+void evict_records(){
+	while(cache_bytes > CACHE_SIZE && clock_size > 0){
+		dns_cache_record_t *record = clock_ring[clock_hand];
+		if(__atomic_load_n(&record->referenced, __ATOMIC_RELAXED)){
+			__atomic_store_n(&record->referenced, false, __ATOMIC_RELAXED);
+			clock_hand = (clock_hand + 1) % clock_size;
+			continue;
+		}
+		// the last record moves into the hand's slot, so the hand stays put.
+		dns_domain_t *domain = record->domain;
+		remove_record(record);
+		prune_domain(domain);
+	}
+}
+
+/**
+ Removes every record that ran out more than STALE_WINDOW ago from the cache, along with any domains left empty.
+ A batch at a time, so inserts arent held up behind a full sweep.
+*/
+void sweep_cache(){
+	int i = 0;
+	while(true){
+		pthread_mutex_lock(&cache_lock);
+		time_t now = time(NULL);
+		for(int batch = 0; batch < SWEEP_BATCH && i < clock_size; batch++){
+			dns_cache_record_t *record = clock_ring[i];
+			if(record->expires + STALE_WINDOW > now){
+				i++;
+				continue;
+			}
+			// the last record moves into slot i, look at i again.
+			dns_domain_t *domain = record->domain;
+			remove_record(record);
+			prune_domain(domain);
+		}
+		bool done = i >= clock_size;
+		reclaim();
+		pthread_mutex_unlock(&cache_lock);
+		if(done){
+			return;
+		}
+	}
+}
+
+/**
+ Writes every record in the cache but the root hints to a snapshot at path, for load_cache to warm the cache with after a restart.
+ The cache is locked a batch at a time like sweep_cache, so a record that moves meanwhile may be missed or written twice.
+ The snapshot goes to path.tmp first and is renamed over path, so one cut short never replaces a good one.
+ returns the number of records written, or -1 on failure.
+*/
+int save_cache(char *path){
+	char tmp_path[PATH_MAX];
+	if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)){
+		return -1;
+	}
+	FILE *file = fopen(tmp_path, "wb");
+	if(file == NULL){
+		printf("failed to open %s\n", tmp_path);
+		return -1;
+	}
+
+	dns_snapshot_header_t header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, time(NULL)};
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	int count = 0;
+	int i = 0;
+	while(ok){
+		pthread_mutex_lock(&cache_lock);
+		time_t now = time(NULL);
+		for(int batch = 0; batch < SWEEP_BATCH && i < clock_size && ok; batch++, i++){
+			int written = write_record(file, clock_ring[i], now);
+			ok = written >= 0;
+			count += written > 0;
+		}
+		bool done = i >= clock_size;
+		pthread_mutex_unlock(&cache_lock);
+		if(done){
+			break;
+		}
+	}
+	if(fclose(file) != 0){
+		ok = false;
+	}
+	if(!ok || rename(tmp_path, path) < 0){
+		printf("failed to write %s\n", path);
+		unlink(tmp_path);
+		return -1;
+	}
+	return count;
+}
+
+/**
+ Writes a record to a snapshot, unless it ran out too long ago to even be served stale. Called with cache_lock held.
+ returns 1 if it was written, 0 if it wasnt, or -1 on failure.
+*/
+int write_record(FILE *file, dns_cache_record_t *record, time_t now){
+	if(record->expires + STALE_WINDOW <= now){
+		return 0;
+	}
+	char domain[255];
+	int domain_length = domain_name(record->domain, domain);
+	int name_length = record->negative == POSITIVE ? 0 : domainname_length(record->rr.Name);
+	dns_snapshot_record_t out = {record->expires, record->ttl, record->rr.Type, record->rr.Class, record->rr.RDLength,
+		record->denied, record->negative, domain_length, name_length};
+	if(fwrite(&out, sizeof(out), 1, file) != 1 || fwrite(domain, domain_length, 1, file) != 1
+			|| (name_length > 0 && fwrite(record->rr.Name, name_length, 1, file) != 1)
+			|| (out.rdlength > 0 && fwrite(record->rr.RData, out.rdlength, 1, file) != 1)){
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ Writes the wire format name of a domain into out (255 bytes), from its labels on the way up to the root.
+ returns its length.
+*/
+int domain_name(dns_domain_t *domain, char *out){
+	int length = 0;
+	for(; domain->label[0] != 0; domain = domain->parent){
+		int label_length = (unsigned char)domain->label[0] + 1;
+		memcpy(out + length, domain->label, label_length);
+		length += label_length;
+	}
+	out[length++] = 0;
+	return length;
+}
+
+/**
+ Warms the cache with the records in a snapshot written by save_cache. The file is mapped rather than read in.
+ Records keep the time they run out at, so the time since the snapshot was written comes off their TTLs,
+ and those that ran out too long ago to even be served stale are left out.
+ Only for starting up, before anything reads the cache.
+ returns the number of records loaded, or -1 if there isnt a snapshot we can use.
+*/
+int load_cache(char *path){
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return -1;
+	}
+	struct stat st;
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(dns_snapshot_header_t)){
+		close(fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED){
+		return -1;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	dns_snapshot_header_t header;
+	memcpy(&header, data, sizeof(header));
+	if(header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION){
+		printf("%s isnt a snapshot we can read\n", path);
+		munmap(data, size);
+		return -1;
+	}
+
+	time_t now = time(NULL);
+	int count = 0;
+	size_t offset = sizeof(header);
+	pthread_mutex_lock(&cache_lock);
+	// stops short of full, past that the rest would only push out what came before them.
+	while(offset + sizeof(dns_snapshot_record_t) <= size && cache_bytes < CACHE_SIZE - CACHE_SIZE / 16){
+		dns_snapshot_record_t in;
+		memcpy(&in, data + offset, sizeof(in));
+		size_t length = sizeof(in) + in.domain_length + in.name_length + in.rdlength;
+		if(offset + length > size){
+			break; // cut short.
+		}
+		char *domain = data + offset + sizeof(in);
+		char *name = in.name_length > 0 ? domain + in.domain_length : domain;
+		char *rdata = domain + in.domain_length + in.name_length;
+		offset += length;
+
+		if(in.expires + STALE_WINDOW <= now || in.negative > NXDOMAIN || !name_valid(domain, in.domain_length)
+				|| (in.name_length > 0 && !name_valid(name, in.name_length)) || !rdata_valid(in.type, rdata, in.rdlength)){
+			continue;
+		}
+		dns_resource_record_t rr = {name, in.type, in.class, in.ttl, in.rdlength, rdata};
+		if(place_record(domain, &rr, in.ttl, in.expires, in.negative, in.denied) == 0){
+			count++;
+		}
+	}
+	reclaim();
+	pthread_mutex_unlock(&cache_lock);
+	munmap(data, size);
+	return count;
+}
+
+/**
+ Checks that length bytes hold exactly one wire format name, with no label too long and nothing after the root label.
+*/
+bool name_valid(char *name, int length){
+	return name_span(name, length) == length;
+}
+
+/**
+ Allocates size bytes for the cache from the slab, and counts them against CACHE_SIZE.
+ Called with cache_lock held. returns NULL on failure.
+*/
+void *cache_alloc(size_t size){
+	void *ptr = slab_alloc(&cache_slab, size);
+	if(ptr != NULL){
+		cache_bytes += slab_size(&cache_slab, size);
+	}
+	return ptr;
+}
+
+/**
+ Frees memory from cache_alloc that no reader has seen, size must be what it was allocated with.
+*/
+void cache_free(void *ptr, size_t size){
+	slab_free(&cache_slab, ptr, size);
+	cache_bytes -= slab_size(&cache_slab, size);
+}
+
+/**
+ Sets memory from cache_alloc aside to be freed once no reader can be using it, after it has been taken out of the cache.
+ It stops counting against CACHE_SIZE straight away. Called with cache_lock held.
+*/
+void retire(void *ptr, size_t size){
+	if(ptr == NULL){
+		return;
+	}
+	cache_bytes -= slab_size(&cache_slab, size);
+	if(retired_no == retired_capacity){
+		int capacity = retired_capacity == 0 ? 1024 : retired_capacity*2;
+		dns_retired_t *resized = realloc(retired, capacity*sizeof(dns_retired_t));
+		if(resized == NULL){
+			return; // leaking it is the only safe thing left to do.
+		}
+		retired = resized;
+		retired_capacity = capacity;
+	}
+	retired[retired_no].ptr = ptr;
+	retired[retired_no].size = size;
+	retired[retired_no].epoch = __atomic_load_n(&cache_epoch, __ATOMIC_RELAXED); // cache_synchronize can move it on without the lock.
+	retired_no++;
+}
+
+/**
+ Frees whatever was retired before every reader last announced an epoch, see cache_quiescent.
+ Starts a new epoch first, so readers that announce it are known to have missed everything retired so far.
+ Called with cache_lock held, at the end of every change to the cache.
+*/
+void reclaim(){
+	if(retired_no == 0){
+		return;
+	}
+	if(retired[retired_no - 1].epoch == __atomic_load_n(&cache_epoch, __ATOMIC_RELAXED)){
+		__atomic_fetch_add(&cache_epoch, 1, __ATOMIC_SEQ_CST);
+	}
+	// pairs with the fence in cache_quiescent, either we see the reader's epoch or it sees our changes.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	uint64_t oldest = UINT64_MAX;
+	int reader_count = __atomic_load_n(&reader_no, __ATOMIC_ACQUIRE);
+	for(int i = 0; i < reader_count; i++){
+		uint64_t epoch = __atomic_load_n(&readers[i].epoch, __ATOMIC_ACQUIRE);
+		if(epoch != 0 && epoch < oldest){
+			oldest = epoch;
+		}
+	}
 
+	// retired in epoch order, so whatever can go is at the front.
+	int freed = 0;
+	while(freed < retired_no && retired[freed].epoch < oldest){
+		slab_free(&cache_slab, retired[freed].ptr, retired[freed].size);
+		freed++;
+	}
+	retired_no -= freed;
+	memmove(retired, retired + freed, retired_no * sizeof(dns_retired_t));
+}
+
+/**
+ Registers a thread that looks things up in the cache, it starts out offline.
+ returns the reader to pass to cache_quiescent and cache_offline, or -1 if there are too many.
+*/
+int cache_reader(){
+	int reader = __atomic_fetch_add(&reader_no, 1, __ATOMIC_ACQ_REL);
+	if(reader >= MAX_READERS){
+		__atomic_fetch_sub(&reader_no, 1, __ATOMIC_ACQ_REL);
+		return -1;
+	}
+	return reader;
+}
+
+/**
+ Announces that the reader holds nothing it got from the cache, so anything retired before now can be freed.
+ Lookups are only safe between this and the next cache_offline.
+*/
+void cache_quiescent(int reader){
+	uint64_t epoch = __atomic_load_n(&cache_epoch, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&readers[reader].epoch, epoch, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ Announces that the reader is going to sleep holding nothing from the cache, so it doesnt hold up reclaim while it waits.
+*/
+void cache_offline(int reader){
+	__atomic_store_n(&readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ Waits until every reader has been quiescent or offline since the call, so none of them can still hold anything
+ that was unpublished before it. For freeing memory the cache doesnt own from a thread that isnt a reader, like old zones.
+*/
+void cache_synchronize(){
+	uint64_t epoch = __atomic_add_fetch(&cache_epoch, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int reader_count = __atomic_load_n(&reader_no, __ATOMIC_ACQUIRE);
+	for(int i = 0; i < reader_count; i++){
+		uint64_t seen;
+		while((seen = __atomic_load_n(&readers[i].epoch, __ATOMIC_ACQUIRE)) != 0 && seen < epoch){
+			usleep(1000);
+		}
+	}
+}
 
 /*
 Attempts to find a domain in the cache with the specified domain name.
 Returns NULL if the domain is not cached.
 */
 dns_domain_t *find_domain(char *domainname){
-	printf("NAME: %s\n", domainname);
 	dns_domain_t *current = super_root;
-	
-	char label[64];
-
-	int start = strlen(domainname);
-	int end = start;
-	while(start >= 0){
-		while(domainname[start] != '.' && start >= 0){
-			start--;
-		}
-		strncpy(label, domainname+start+1, end-start);
-		label[end-start-1] = '\0';
-		end = start;
-		start--;
-
-		bool found = false;
-		for(int i = 0; i < current->domain_no; i++){
-			if(strcmp(current->domains[i]->label, label) == 0){
-				current = current->domains[i];
-				found = true;
-				break;
-			}
-		}
-		if(!found){
+
+	char *labels[128];
+	int label_no = split_labels(domainname, labels);
+	for(int i = 0; i < label_no; i++){
+		current = find_subdomain(current, labels[i], label_hash(labels[i]));
+		if(current == NULL){
 			return NULL;
 		}
 	}
@@ -190,25 +1263,300 @@ dns_domain_t *find_domain(char *domainname){
 	return current;
 }
 
+/**
+ Encodes the records of a domain that answer the given type and class, at most max of them, as answers named owner.
+ Their TTLs are counted down to the time left before they expire.
+ Expired records are skipped, the sweeper takes them out.
+ *last is set to the last record encoded, and each one is noted in source.
+ Only reads the cache, apart from the referenced bits, so it needs no lock.
+
+ returns the number of records encoded, or -1 if they didnt all fit.
+*/
+int encode_records(dns_domain_t *domain, uint16_t qtype, uint16_t qclass, char *owner, dns_encoder_t *encoder, int max, dns_cache_record_t **last, dns_answer_source_t *source, bool stale){
+	int count = 0;
+	time_t now = time(NULL);
+
+	dns_record_set_t *set = __atomic_load_n(qtype == QT_NS ? &domain->ns_records : &domain->records, __ATOMIC_ACQUIRE);
+	if(set == NULL){
+		return 0;
+	}
+	int record_no = __atomic_load_n(&set->count, __ATOMIC_ACQUIRE);
+
+	for(int i = 0; i < record_no && count < max; i++){
+		dns_cache_record_t *record = set->records[i];
+		dns_resource_record_t rr = record->rr;
+		time_t expires = __atomic_load_n(&record->expires, __ATOMIC_RELAXED);
+		if(!record_live(expires, now, stale) || record->negative != POSITIVE){
+			continue;
+		}
+		if(qtype != QT_ALL && rr.Type != qtype){
+			continue;
+		}
+		if(qclass != QC_ALL && rr.Class != qclass){
+			continue;
+		}
+		if(expires != 0){
+			rr.TTL = expires > now ? expires - now : STALE_TTL;
+		}
+		int ttl_offset = encode_record(encoder, ANSWER, owner, &rr);
+		if(ttl_offset < 0){
+			return -1;
+		}
+		note_record(record, expires, now, ttl_offset, source);
+		*last = record;
+		count++;
+	}
+	return count;
+}
+
+/**
+ Encodes the SOA of a negative answer cached for the domain that covers the question, into the authority section.
+ NXDOMAIN is put in the header if that is what it is, a NODATA leaves the RCode alone.
+ Its TTL counts down like any other record's, and it is noted in source.
+
+ returns 1 if there was one, 0 if there wasnt, or -1 if it didnt fit.
+*/
+int encode_negative(dns_domain_t *domain, uint16_t qtype, uint16_t qclass, dns_encoder_t *encoder, dns_answer_source_t *source, bool stale){
+	time_t now = time(NULL);
+	dns_record_set_t *set = __atomic_load_n(&domain->records, __ATOMIC_ACQUIRE);
+	if(set == NULL){
+		return 0;
+	}
+	int record_no = __atomic_load_n(&set->count, __ATOMIC_ACQUIRE);
+
+	for(int i = 0; i < record_no; i++){
+		dns_cache_record_t *record = set->records[i];
+		dns_resource_record_t rr = record->rr;
+		time_t expires = __atomic_load_n(&record->expires, __ATOMIC_RELAXED);
+		if(record->negative == POSITIVE || !record_live(expires, now, stale)){
+			continue;
+		}
+		if(record->negative == NODATA && record->denied != qtype){
+			continue;
+		}
+		if(qclass != QC_ALL && rr.Class != qclass){
+			continue;
+		}
+		rr.TTL = expires > now ? expires - now : STALE_TTL;
+		int ttl_offset = encode_record(encoder, AUTHORITY, rr.Name, &rr);
+		if(ttl_offset < 0){
+			return -1;
+		}
+		note_record(record, expires, now, ttl_offset, source);
+		if(record->negative == NXDOMAIN){
+			encoder->buf[3] = (encoder->buf[3] & 0xF0) | 3;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ Checks whether a record that runs out at expires can go in an answer at now.
+ With stale set, so can one that ran out less than STALE_WINDOW ago.
+*/
+bool record_live(time_t expires, time_t now, bool stale){
+	return expires == 0 || expires > now || (stale && expires + STALE_WINDOW > now);
+}
+
+/**
+ Notes a record that went into an answer in the answer's source, and marks it as used for the clock hand.
+ Once the record is due to be refreshed its hits are counted, so only records that are about to run out are written to.
+*/
+void note_record(dns_cache_record_t *record, time_t expires, time_t now, int ttl_offset, dns_answer_source_t *source){
+	if(source->record_no >= 0 && source->record_no < MAX_SOURCE_RECORDS){
+		source->ttl_offsets[source->record_no] = ttl_offset;
+		source->expires[source->record_no] = expires;
+		source->record_no++;
+	}else{
+		source->record_no = -1; // too many to keep track of.
+	}
+	// other readers may be setting it too. checking first keeps the cache line clean for hot records.
+	if(!__atomic_load_n(&record->referenced, __ATOMIC_RELAXED)){
+		__atomic_store_n(&record->referenced, true, __ATOMIC_RELAXED);
+	}
+
+	if(expires == 0){
+		return;
+	}
+	time_t refresh = expires - __atomic_load_n(&record->ttl, __ATOMIC_RELAXED) / PREFETCH_FRACTION;
+	if(source->refresh == 0 || refresh < source->refresh){
+		source->refresh = refresh;
+	}
+	// only the answer that makes it hot asks for a refresh, the ones after it would just ask again.
+	// caching the refreshed answer restarts the record and its hits.
+	if(now >= refresh && expires > now && __atomic_add_fetch(&record->hits, 1, __ATOMIC_RELAXED) == PREFETCH_HITS){
+		source->prefetch = true;
+	}
+}
+
+/**
+ Answers a question from the cache, encoding the answers straight from the cached records.
+ CNAMEs are followed, so the answer holds the chain followed by the records at the end of it.
+ If there are none there but a negative answer is cached, its SOA goes in the authority section instead.
+ If the cache can't answer, whatever was encoded has to be thrown away.
+ source is filled in with what the answer was made from.
+ With stale set, records that ran out less than STALE_WINDOW ago are used as well, for when upstream has failed us.
+
+ returns the number of records in the answer (with the SOA of a negative one), 0 if the cache can't answer the question,
+ or -1 if the answer doesnt fit.
+*/
+int lookup_records(dns_question_t *question, dns_encoder_t *encoder, dns_answer_source_t *source, bool stale){
+	// answers are named as asked, rather than however the cached records happen to be capitalised.
+	char *name = question->QName;
+	dns_cache_record_t *last = NULL;
+	source->domain_no = 0;
+	source->record_no = 0;
+	source->refresh = 0;
+	source->prefetch = false;
+
+	int count = 0;
+	for(int hops = 0; hops < MAX_CHAIN; hops++){ // bound the length of CNAME chains we will follow
+		dns_domain_t *domain = find_domain(name);
+		if(domain == NULL){
+			break;
+		}
+		uint32_t slot = generation_slot(domain);
+		source->slots[source->domain_no] = slot;
+		source->generations[source->domain_no] = cache_generation(slot);
+		source->domain_no++;
+
+		int found = encode_records(domain, question->QType, question->QClass, name, encoder, INT_MAX, &last, source, stale);
+		if(found != 0){
+			return found < 0 ? -1 : count + found;
+		}
+
+		if(question->QType != QT_CNAME){
+			found = encode_records(domain, T_CNAME, question->QClass, name, encoder, 1, &last, source, stale);
+			if(found < 0){
+				return -1;
+			}
+			if(found > 0){
+				name = last->rr.RData; // not freed before we are next quiescent, so its safe to keep using it.
+				count++;
+				continue;
+			}
+		}
+
+		// nothing to answer with, unless we were told there is nothing.
+		found = encode_negative(domain, question->QType, question->QClass, encoder, source, stale);
+		return found <= 0 ? found : count + found;
+	}
+	return 0;
+}
+
+/**
+ Prints how much memory the cache holds and what that comes to per record, for sizing hosts.
+ Overhead is everything but the names and RData themselves: record headers, domains, tables,
+ rounding up to size classes, and slab space that is free or waiting to be reclaimed.
+*/
+void print_cache_stats(){
+	pthread_mutex_lock(&cache_lock);
+	size_t allocated = slab_bytes(&cache_slab);
+	printf("cache: %d records, %d domains, %zu bytes in use, %zu allocated\n", clock_size, domain_count, cache_bytes, allocated);
+	if(clock_size > 0){
+		printf("cache: %zu bytes per record, %zu of them overhead\n", allocated / clock_size, (allocated - payload_bytes) / clock_size);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ Finds the servers to ask about a name when resolving it ourselves: those of the closest zone above it
+ that the cache has NS records for, and the addresses of at least one of them.
+ zone is set to the zone's name, and up to max IPv4 addresses (in network order) are put in addresses.
+ A zone whose servers we dont have addresses for is skipped, but if one of them is outside the zone
+ (so asking the zone itself isnt needed to find it) its name is put in missing, to be looked up first.
+ zone and missing need room for a 255 byte name, missing is left empty if there isnt one.
+
+ returns the number of addresses, 0 if we have to look up missing first.
+*/
+int find_servers(char *name, char *zone, uint32_t *addresses, int max, char *missing){
+	dns_domain_t *domains[128];
+	char *labels[128];
+	int label_no = split_labels(name, labels);
+	missing[0] = 0;
+
+	dns_domain_t *current = super_root;
+	int depth = 0;
+	while(depth < label_no && (current = find_subdomain(current, labels[depth], label_hash(labels[depth]))) != NULL){
+		domains[depth++] = current;
+	}
+
+	// from the closest zone upwards, the root always has its hints.
+	for(int i = depth - 1; i >= 0; i--){
+		memcpy(zone, labels[i], domainname_length(labels[i]));
+		int count = zone_addresses(domains[i], zone, addresses, max, missing);
+		if(count > 0 || missing[0] != 0){
+			return count;
+		}
+	}
+	return 0;
+}
+
+/**
+ Collects the addresses of a zone's servers from the cache, see find_servers.
+ returns the number of addresses.
+*/
+int zone_addresses(dns_domain_t *domain, char *zone, uint32_t *addresses, int max, char *missing){
+	time_t now = time(NULL);
+	dns_record_set_t *servers = __atomic_load_n(&domain->ns_records, __ATOMIC_ACQUIRE);
+	int server_no = servers == NULL ? 0 : __atomic_load_n(&servers->count, __ATOMIC_ACQUIRE);
+	int count = 0;
+	char *outside = NULL;
+
+	for(int i = 0; i < server_no && count < max; i++){
+		dns_cache_record_t *server = servers->records[i];
+		time_t expires = __atomic_load_n(&server->expires, __ATOMIC_RELAXED);
+		if(expires != 0 && expires <= now){
+			continue;
+		}
+		dns_domain_t *host = find_domain(server->rr.RData);
+		dns_record_set_t *records = host == NULL ? NULL : __atomic_load_n(&host->records, __ATOMIC_ACQUIRE);
+		int record_no = records == NULL ? 0 : __atomic_load_n(&records->count, __ATOMIC_ACQUIRE);
+		int found = 0;
+		for(int j = 0; j < record_no && count < max; j++){
+			dns_cache_record_t *record = records->records[j];
+			expires = __atomic_load_n(&record->expires, __ATOMIC_RELAXED);
+			if(record->negative != POSITIVE || record->rr.Type != T_A || record->rr.RDLength != 4 || (expires != 0 && expires <= now)){
+				continue;
+			}
+			memcpy(&addresses[count++], record->rr.RData, 4);
+			found++;
+		}
+		if(found == 0 && outside == NULL && !name_under(server->rr.RData, zone)){
+			outside = server->rr.RData;
+		}
+	}
+	if(count == 0 && outside != NULL){
+		memcpy(missing, outside, domainname_length(outside));
+	}
+	return count;
+}
+
 void print_domain(dns_domain_t *domain){
 	printf("DOMAIN:\n");
-	printf("Label: .%s\n", domain->label);
-	printf("Name servers: %d\n", domain->ns_record_no);
-	/*for(int i = 0; i < domain->ns_record_no; i ++){
-		print_rr(domain->ns_records[i]);
+	printf("Label: .%.*s\n", domain->label[0], domain->label+1);
+	printf("Name servers: %d\n", domain->ns_records == NULL ? 0 : domain->ns_records->count);
+	/*for(int i = 0; i < domain->ns_records->count; i ++){
+		print_rr(&domain->ns_records->records[i]->rr);
 	}*/
-	printf("Records: %d\n", domain->record_no);
+	printf("Records: %d\n", domain->records == NULL ? 0 : domain->records->count);
 	printf("Subdomains: %d\n", domain->domain_no);
-	for(int i = 0; i < domain->domain_no; i ++){
-		printf("%s ", domain->domains[i]->label);
+	for(int i = 0; domain->domains != NULL && i < domain->domains->capacity; i ++){
+		dns_domain_t *subdomain = domain->domains->slots[i];
+		if(subdomain != NULL){
+			printf("%.*s ", subdomain->label[0], subdomain->label+1);
+		}
 	}
 	printf("\n");
 }
 
 void print_all(dns_domain_t *domain){
 	print_domain(domain);
-	for(int i = 0; i < domain->domain_no; i ++){
-		print_all(domain->domains[i]);
+	for(int i = 0; domain->domains != NULL && i < domain->domains->capacity; i ++){
+		if(domain->domains->slots[i] != NULL){
+			print_all(domain->domains->slots[i]);
+		}
 	}
 	printf("\n");
 }
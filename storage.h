@@ -1,26 +1,96 @@
 #ifndef STORAGE_H
 #define STORAGE_H
 
+#include <time.h>
+#include <stdbool.h>
 #include "dns.h"
 
+struct dns_domain;
+
+// What a cached record says about its domain.
+enum NEGATIVE {
+	POSITIVE, // its an ordinary record of the domain.
+	NODATA, // the domain has no records of the denied type, rr is the SOA that said so.
+	NXDOMAIN // the domain doesnt exist at all, rr is the SOA that said so.
+};
+
+// A record held in the cache, a deep copy of the record from the packet it came in.
+typedef struct dns_cache_record{
+	dns_resource_record_t rr;
+	time_t expires; // absolute time the record runs out, 0 if it never does. It is kept a while after, in case it has to be served stale.
+	bool referenced; // set when the record is used in an answer, cleared as the clock hand passes.
+	uint8_t negative; // see enum NEGATIVE, negative answers are kept with the domain's other records.
+	uint32_t hits; // answers it went in since it was due to be refreshed, see PREFETCH_HITS.
+	uint32_t ttl; // TTL it was last stored with, capped. Restarting the record changes it, so its only read atomically.
+	uint16_t denied; // type a NODATA answer is for.
+	int clock_index; // position in the clock ring, -1 if the record can't be evicted.
+	struct dns_domain *domain; // domain the record is cached under.
+} dns_cache_record_t;
+
+// The records of a domain. Lookups read it without a lock, so a set is only changed in place by
+// appending past the count, anything else replaces the whole set.
+typedef struct dns_record_set{
+	int count;
+	int capacity;
+	dns_cache_record_t *records[];
+} dns_record_set_t;
+
+// Open addressing table of subdomains keyed by hash, empty slots are NULL.
+typedef struct dns_domain_table{
+	int capacity; // a power of two
+	struct dns_domain *slots[];
+} dns_domain_table_t;
+
 // dns cache is a tree of domains.
 // At the base is the root domain ""
 // Which has children like "com","org","uk","fm", etc.
 // Each domain 
+// Lookups walk the tree without taking cache_lock, anything they can reach is only freed once every worker
+// has passed a quiescent point, see cache_quiescent.
 typedef struct dns_domain{
-	char label[64];
-	int ns_record_no;
-	dns_resource_record_t** ns_records; // NS records for this domain, for easy access
-	int record_no;
-	dns_resource_record_t** records;
-	int domain_no;
-	struct dns_domain** domains;
+	uint32_t hash; // label_hash of the label, so lookups only compare labels that are likely to match.
+	struct dns_domain *parent;
+	dns_record_set_t *ns_records; // NS records for this domain, for easy access. NULL if there are none.
+	dns_record_set_t *records;
+	int domain_no; // only used under cache_lock.
+	dns_domain_table_t *domains; // NULL before the first subdomain.
+	char label[]; // length prefixed, as in a wire format name. domains are allocated to fit theirs.
 } dns_domain_t;
 
+//Most CNAMEs followed when answering from the cache.
+#define MAX_CHAIN 8
+//Most records an answer can have for dns_answer_source_t to keep track of them all.
+#define MAX_SOURCE_RECORDS 64
+
+// What an answer from the cache was made from, so a copy of it can be kept up to date and thrown out when it isnt.
+// Domains are tracked by generation: the slot a domain hashes to is bumped whenever its records change.
+typedef struct dns_answer_source{
+	int domain_no;
+	uint32_t slots[MAX_CHAIN]; // generation slots of the domains it came from.
+	uint32_t generations[MAX_CHAIN]; // and their generations when it was made.
+	int record_no; // -1 if there were more than MAX_SOURCE_RECORDS.
+	uint16_t ttl_offsets[MAX_SOURCE_RECORDS]; // where each record's TTL is in the message.
+	time_t expires[MAX_SOURCE_RECORDS]; // when each record runs out, 0 if it doesnt.
+	time_t refresh; // first time a record in it is due to be refreshed, 0 if none are.
+	bool prefetch; // a record in it is due and hot, the question should be asked again before it runs out.
+} dns_answer_source_t;
+
 int init_cache();
-void cache_all(dns_packet_t *);
+void cache_all(dns_packet_t *, char *);
 int insert_record(dns_resource_record_t *);
 dns_domain_t *find_domain(char *);
+int lookup_records(dns_question_t *, dns_encoder_t *, dns_answer_source_t *, bool);
+uint32_t cache_generation(uint32_t);
+int find_servers(char *, char *, uint32_t *, int, char *);
+bool name_equal(char *, char *);
+void sweep_cache();
+int save_cache(char *);
+int load_cache(char *);
 void print_domain(dns_domain_t *);
+void print_cache_stats();
+int cache_reader();
+void cache_quiescent(int);
+void cache_offline(int);
+void cache_synchronize();
 
 #endif
@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "tcp.h"
+
+/**
+ Sets up a connection in a free slot for the given (non blocking) socket.
+ server is the upstream server it goes to, NULL for a client.
+ returns -1 if the buffers could not be allocated, the socket is closed.
+*/
+int tcp_open(dns_tcp_conn_t *conn, int fd, struct sockaddr_in *server){
+	conn->in = malloc(2 + TCP_MESSAGE_SIZE);
+	if(conn->in == NULL){
+		close(fd);
+		return -1;
+	}
+	conn->fd = fd;
+	conn->upstream = server != NULL;
+	if(server != NULL){
+		conn->server = *server;
+	}
+	conn->connecting = false;
+	conn->want_write = false;
+	conn->reading = true;
+	conn->read_closed = false;
+	conn->waiting = 0;
+	conn->outstanding = 0;
+	conn->in_length = 0;
+	conn->out = NULL;
+	conn->out_length = 0;
+	conn->out_capacity = 0;
+	return 0;
+}
+
+/**
+ Closes the connection and frees its buffers, the slot can be reused.
+*/
+void tcp_close(dns_tcp_conn_t *conn){
+	close(conn->fd);
+	free(conn->in);
+	free(conn->out);
+	conn->fd = -1;
+	conn->in = NULL;
+	conn->out = NULL;
+	conn->generation++;
+}
+
+/**
+ Reads whatever has arrived into the input buffer, without blocking.
+ returns 1 if the other end has shut its side (the messages before that are still in the buffer), -1 if it broke.
+*/
+int tcp_receive(dns_tcp_conn_t *conn){
+	while(conn->in_length < 2 + TCP_MESSAGE_SIZE){
+		ssize_t bytes = read(conn->fd, conn->in + conn->in_length, 2 + TCP_MESSAGE_SIZE - conn->in_length);
+		if(bytes < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		if(bytes == 0){
+			return 1;
+		}
+		conn->in_length += bytes;
+	}
+	return 0;
+}
+
+/**
+ Finds the message starting at offset in the input buffer, if all of it has arrived.
+ returns its length with *message pointing at it, or -1 if it isnt complete yet.
+*/
+int tcp_message(dns_tcp_conn_t *conn, int offset, char **message){
+	if(conn->in_length - offset < 2){
+		return -1;
+	}
+	int length = ntohs(*(uint16_t *)(conn->in + offset));
+	if(conn->in_length - offset - 2 < length){
+		return -1;
+	}
+	*message = conn->in + offset + 2;
+	return length;
+}
+
+/**
+ Drops bytes from the front of the input buffer, once the messages in them are handled.
+*/
+void tcp_consume(dns_tcp_conn_t *conn, int bytes){
+	memmove(conn->in, conn->in + bytes, conn->in_length - bytes);
+	conn->in_length -= bytes;
+}
+
+/**
+ Adds a message to the output buffer with its length in front, to go out on the next tcp_flush.
+ returns where the copy of the message is, so it can still be changed, or NULL if the connection has too much waiting.
+*/
+char *tcp_queue(dns_tcp_conn_t *conn, char *message, int length){
+	int needed = conn->out_length + 2 + length;
+	if(needed > TCP_OUT_LIMIT){
+		return NULL;
+	}
+	if(needed > conn->out_capacity){
+		int capacity = conn->out_capacity == 0 ? 4096 : conn->out_capacity;
+		while(capacity < needed){
+			capacity *= 2;
+		}
+		char *out = realloc(conn->out, capacity);
+		if(out == NULL){
+			return NULL;
+		}
+		conn->out = out;
+		conn->out_capacity = capacity;
+	}
+
+	*(uint16_t *)(conn->out + conn->out_length) = htons(length);
+	char *copy = conn->out + conn->out_length + 2;
+	memcpy(copy, message, length);
+	conn->out_length = needed;
+	return copy;
+}
+
+/**
+ Writes as much of the output buffer as the socket will take without blocking.
+ returns -1 if the connection broke.
+*/
+int tcp_flush(dns_tcp_conn_t *conn){
+	if(conn->connecting){
+		return 0;
+	}
+	int written = 0;
+	while(written < conn->out_length){
+		ssize_t bytes = send(conn->fd, conn->out + written, conn->out_length - written, MSG_NOSIGNAL);
+		if(bytes < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				break;
+			}
+			return -1;
+		}
+		written += bytes;
+	}
+	memmove(conn->out, conn->out + written, conn->out_length - written);
+	conn->out_length -= written;
+	return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef TCP_H
+#define TCP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+//Largest DNS message, TCP messages carry a 2 byte length.
+#define TCP_MESSAGE_SIZE 65535
+//Most bytes of replies we will hold for a connection that isnt reading them.
+#define TCP_OUT_LIMIT (1024 * 1024)
+
+// A TCP connection carrying length prefixed DNS messages, to a client or to an upstream server.
+typedef struct dns_tcp_conn{
+	int fd; // -1 if the slot is free
+	uint32_t generation; // bumped when the slot is reused, so old references to it can be told apart
+	bool upstream; // its to an upstream server, rather than from a client
+	struct sockaddr_in server; // the upstream server it goes to
+	bool connecting; // upstream connections wait for connect to finish before writing
+	bool want_write; // whether epoll is watching it for writes
+	bool reading; // whether epoll is watching it for reads
+	bool read_closed; // the client has shut its side, it is closed once its queries are answered and the replies written
+	int waiting; // queries from a client on it that are waiting on a pending query
+	int outstanding; // queries sent on an upstream connection that havent been answered
+	uint64_t last_active; // ms
+
+	char *in; // 2 + TCP_MESSAGE_SIZE bytes
+	int in_length;
+	char *out;
+	int out_length;
+	int out_capacity;
+} dns_tcp_conn_t;
+
+int tcp_open(dns_tcp_conn_t *conn, int fd, struct sockaddr_in *server);
+void tcp_close(dns_tcp_conn_t *conn);
+int tcp_receive(dns_tcp_conn_t *conn);
+int tcp_message(dns_tcp_conn_t *conn, int offset, char **message);
+void tcp_consume(dns_tcp_conn_t *conn, int bytes);
+char *tcp_queue(dns_tcp_conn_t *conn, char *message, int length);
+int tcp_flush(dns_tcp_conn_t *conn);
+
+#endif
@@ -0,0 +1,169 @@
+"""
+Mock authoritative servers for testing iterative resolution, all on loopback addresses.
+
+  127.0.0.2:5353  the root (give it to the resolver with -u), refers test. and other.
+  127.0.0.3:53    test., refers example.test. and lame.test. with glue,
+                  and bad.test. to ns.other. with out of bailiwick glue that points nowhere.
+  127.0.0.4:53    example.test.
+  127.0.0.5:53    other., has the real address of ns.other.
+  127.0.0.6:53    bad.test. and lame.test., where every name starting with x has an address.
+  127.0.0.7:53    a lame server for lame.test., it refuses everything.
+
+Every query a server gets is logged as (server, name, type), see MockServers.log.
+Run it on its own to poke at it by hand.
+"""
+import socket, struct, threading
+
+TYPES = {"A": 1, "NS": 2, "CNAME": 5, "SOA": 6, "OPT": 41}
+TYPE_NAMES = {v: k for k, v in TYPES.items()}
+
+def encode_name(name):
+    out = b""
+    for label in name.strip(".").split("."):
+        if label:
+            out += bytes([len(label)]) + label.encode()
+    return out + b"\0"
+
+def decode_name(data, offset):
+    """returns the name at offset, and the offset after it in the message."""
+    labels = []
+    end = None
+    hops = 0
+    while True:
+        length = data[offset]
+        if length & 0xC0 == 0xC0:
+            if end is None:
+                end = offset + 2
+            offset = ((length & 0x3F) << 8) | data[offset + 1]
+            hops += 1
+            if hops > 32:
+                raise ValueError("compression loop")
+            continue
+        if length == 0:
+            return ".".join(labels) + ".", end if end is not None else offset + 1
+        labels.append(data[offset + 1:offset + 1 + length].decode(errors="replace"))
+        offset += 1 + length
+
+def record(name, rtype, ttl, rdata):
+    return encode_name(name) + struct.pack("!HHIH", TYPES[rtype], 1, ttl, len(rdata)) + rdata
+
+def address(ip):
+    return bytes(int(x) for x in ip.split("."))
+
+def soa(zone):
+    return record(zone, "SOA", 300, encode_name("ns." + zone) + encode_name("admin." + zone) + struct.pack("!IIIII", 1, 3600, 600, 86400, 60))
+
+def under(name, zone):
+    return name == zone or name.endswith("." + zone)
+
+def query(name, rtype="A", qid=0x1234, rd=True):
+    return struct.pack("!HHHHHH", qid, 0x0100 if rd else 0, 1, 0, 0, 0) + encode_name(name) + struct.pack("!HH", TYPES[rtype], 1)
+
+def parse(data):
+    """Parses a response into a dict of its id, rcode, aa and sections, records are (name, type, ttl, value)."""
+    qid, flags, qdcount, ancount, nscount, arcount = struct.unpack("!HHHHHH", data[:12])
+    result = {"id": qid, "rcode": flags & 15, "aa": (flags >> 10) & 1, "an": [], "ns": [], "ar": []}
+    offset = 12
+    for _ in range(qdcount):
+        _, offset = decode_name(data, offset)
+        offset += 4
+    for section, count in (("an", ancount), ("ns", nscount), ("ar", arcount)):
+        for _ in range(count):
+            name, offset = decode_name(data, offset)
+            rtype, _, ttl, length = struct.unpack("!HHIH", data[offset:offset + 10])
+            offset += 10
+            rdata = data[offset:offset + length]
+            if rtype == 1:
+                value = ".".join(str(b) for b in rdata)
+            elif rtype in (2, 5):
+                value = decode_name(data, offset)[0]
+            else:
+                value = rdata
+            offset += length
+            result[section].append((name.lower(), TYPE_NAMES.get(rtype, rtype), ttl, value))
+    return result
+
+# Each zone answers with (rcode, aa, answers, authorities, additionals).
+
+def root(name, rtype):
+    if under(name, "test"):
+        return 0, False, [], [record("test", "NS", 86400, encode_name("ns1.nic.test"))], [record("ns1.nic.test", "A", 86400, address("127.0.0.3"))]
+    if under(name, "other"):
+        return 0, False, [], [record("other", "NS", 86400, encode_name("ns.other-dns.test"))], []
+    return 3, True, [], [soa("")], []
+
+def tld(name, rtype):
+    if under(name, "example.test"):
+        return 0, False, [], [record("example.test", "NS", 3600, encode_name("ns1.example.test"))], [record("ns1.example.test", "A", 3600, address("127.0.0.4"))]
+    if under(name, "lame.test"):
+        return 0, False, [], [record("lame.test", "NS", 3600, encode_name("ns1.lame.test")), record("lame.test", "NS", 3600, encode_name("ns2.lame.test"))], \
+            [record("ns1.lame.test", "A", 3600, address("127.0.0.7")), record("ns2.lame.test", "A", 3600, address("127.0.0.6"))]
+    if under(name, "bad.test"):
+        # ns.other isnt under test., so we have no say over its address.
+        return 0, False, [], [record("bad.test", "NS", 3600, encode_name("ns.other"))], [record("ns.other", "A", 3600, address("127.0.0.66"))]
+    if name == "ns.other-dns.test" and rtype == 1:
+        return 0, True, [record(name, "A", 3600, address("127.0.0.5"))], [], []
+    return 3, True, [], [soa("test")], []
+
+def example(name, rtype):
+    if name == "a.example.test" and rtype == 1:
+        # evil.com isnt ours to answer for, it mustnt be cached.
+        return 0, True, [record(name, "A", 300, address("10.1.1.1")), record("evil.com", "A", 300, address("6.6.6.6"))], [], []
+    if name == "www.example.test":
+        return 0, True, [record(name, "CNAME", 300, encode_name("host.other"))], [], []
+    return 3, True, [], [soa("example.test")], []
+
+def other(name, rtype):
+    if name == "host.other" and rtype == 1:
+        return 0, True, [record(name, "A", 300, address("10.2.2.2"))], [], []
+    if name == "ns.other" and rtype == 1:
+        return 0, True, [record(name, "A", 3600, address("127.0.0.6"))], [], []
+    return 3, True, [], [soa("other")], []
+
+def leaf(name, rtype):
+    if name == "x.bad.test" and rtype == 1:
+        return 0, True, [record(name, "A", 300, address("10.3.3.3"))], [], []
+    if under(name, "lame.test") and name.startswith("x") and rtype == 1:
+        return 0, True, [record(name, "A", 300, address("10.4.4.4"))], [], []
+    zone = "bad.test" if under(name, "bad.test") else "lame.test"
+    return 3, True, [], [soa(zone)], []
+
+def lame(name, rtype):
+    return 5, False, [], [], []
+
+SERVERS = (("127.0.0.2", 5353, root), ("127.0.0.3", 53, tld), ("127.0.0.4", 53, example),
+           ("127.0.0.5", 53, other), ("127.0.0.6", 53, leaf), ("127.0.0.7", 53, lame))
+
+class MockServers:
+    def __init__(self):
+        self.log = []
+        self.lock = threading.Lock()
+        self.sockets = []
+        for addr, port, zone in SERVERS:
+            s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            s.bind((addr, port))
+            self.sockets.append(s)
+            threading.Thread(target=self.serve, args=(s, addr, zone), daemon=True).start()
+
+    def serve(self, s, addr, zone):
+        while True:
+            data, peer = s.recvfrom(4096)
+            qid, flags = struct.unpack("!HH", data[:4])
+            name, offset = decode_name(data, 12)
+            rtype = struct.unpack("!H", data[offset:offset + 2])[0]
+            name = name.lower().rstrip(".")
+            with self.lock:
+                self.log.append((addr, name, rtype))
+            rcode, aa, an, ns, ar = zone(name, rtype)
+            flags = 0x8000 | (0x400 if aa else 0) | (flags & 0x100) | rcode
+            reply = struct.pack("!HHHHHH", qid, flags, 1, len(an), len(ns), len(ar)) + data[12:offset + 4] + b"".join(an + ns + ar)
+            s.sendto(reply, peer)
+
+    def queries(self, start=0):
+        with self.lock:
+            return self.log[start:]
+
+if __name__ == "__main__":
+    servers = MockServers()
+    threading.Event().wait()
@@ -0,0 +1,80 @@
+"""
+Tests iterative resolution (-i) against the mock authoritative servers in mock_auth.py.
+Starts the server given as the first argument, so it needs to be able to bind port 53.
+"""
+import os, socket, subprocess, sys, time
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from mock_auth import MockServers, query, parse
+
+failures = 0
+
+def check(what, ok, detail=""):
+    global failures
+    print(("ok   " if ok else "FAIL ") + what + ("" if ok else ": " + str(detail)))
+    if not ok:
+        failures += 1
+
+def ask(name, rtype="A"):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(5)
+    s.sendto(query(name, rtype), ("127.0.0.1", 53))
+    try:
+        return parse(s.recvfrom(65535)[0])
+    except socket.timeout:
+        return None
+    finally:
+        s.close()
+
+def addresses(response, name):
+    return [r[3] for r in response["an"] if r[0] == name + "." and r[1] == "A"] if response else []
+
+def main():
+    mocks = MockServers()
+    server = subprocess.Popen([sys.argv[1] if len(sys.argv) > 1 else "./dns", "-i", "-u", "127.0.0.2:5353", "-w", "1"],
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        time.sleep(0.5)
+        check("server started", server.poll() is None)
+
+        r = ask("a.example.test")
+        check("root, TLD and leaf referrals with glue lead to the answer", addresses(r, "a.example.test") == ["10.1.1.1"], r)
+
+        start = len(mocks.queries())
+        r = ask("nothere.example.test")
+        check("a name that doesnt exist is NXDOMAIN", r is not None and r["rcode"] == 3, r)
+        asked = {q[0] for q in mocks.queries(start)}
+        check("a second lookup under a known zone skips the upper levels", asked == {"127.0.0.4"}, asked)
+
+        r = ask("evil.com")
+        check("records a server isnt authoritative for arent cached", "6.6.6.6" not in addresses(r, "evil.com") and r is not None and r["rcode"] == 3, r)
+
+        r = ask("www.example.test")
+        check("a CNAME into another zone is followed", addresses(r, "host.other") == ["10.2.2.2"], r)
+
+        r = ask("x.bad.test")
+        check("out of bailiwick glue is looked up instead of used", addresses(r, "x.bad.test") == ["10.3.3.3"], r)
+        check("the bogus glue address is never asked", not any(q[0] == "127.0.0.66" for q in mocks.queries()))
+        r = ask("ns.other")
+        check("the bogus glue isnt cached", addresses(r, "ns.other") == ["127.0.0.6"], r)
+
+        # servers are tried from a random one, so ask until the lame one has been tried first.
+        answered = True
+        for i in range(20):
+            r = ask("x%d.lame.test" % i)
+            answered = answered and addresses(r, "x%d.lame.test" % i) == ["10.4.4.4"]
+            if any(q[0] == "127.0.0.7" for q in mocks.queries()):
+                break
+        check("a lame server is passed over for one that answers", answered and any(q[0] == "127.0.0.7" for q in mocks.queries()), r)
+
+        start = len(mocks.queries())
+        r = ask("a.example.test")
+        check("a cached answer doesnt go upstream", addresses(r, "a.example.test") == ["10.1.1.1"] and mocks.queries(start) == [], mocks.queries(start))
+    finally:
+        server.terminate()
+        server.wait()
+
+    print("%d failed" % failures if failures else "all passed")
+    sys.exit(1 if failures else 0)
+
+if __name__ == "__main__":
+    main()
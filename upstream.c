@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "upstream.h"
+
+//Port we send to when a server is given without one.
+#define DEFAULT_PORT 53
+//Timeouts in a row before a server is taken out of rotation.
+#define FAILURE_LIMIT 3
+//How long a server stays out of rotation, in ms.
+#define DOWN_TIME 5000
+//Bounds on how long we wait for a first attempt, in ms.
+#define MIN_TIMEOUT 200
+#define MAX_TIMEOUT 2000
+
+/**
+ Reads a server address like "1.2.3.4" or "1.2.3.4:5353".
+ returns -1 if it isnt one.
+*/
+int upstream_parse(char *text, dns_upstream_t *upstream){
+	char address[INET_ADDRSTRLEN];
+	int port = DEFAULT_PORT;
+
+	char *colon = strchr(text, ':');
+	size_t length = colon == NULL ? strlen(text) : colon - text;
+	if(length >= sizeof(address)){
+		return -1;
+	}
+	memcpy(address, text, length);
+	address[length] = 0;
+	if(colon != NULL){
+		port = atoi(colon + 1);
+		if(port <= 0 || port > 65535){
+			return -1;
+		}
+	}
+
+	memset(upstream, 0, sizeof(*upstream));
+	upstream->addr.sin_family = AF_INET;
+	upstream->addr.sin_port = htons(port);
+	if(inet_pton(AF_INET, address, &upstream->addr.sin_addr) != 1){
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ Finds which of the servers an answer came from, by address and port.
+ returns its index, or -1 if it isnt one of ours.
+*/
+int upstream_find(dns_upstream_t *upstreams, int n, struct sockaddr *sa){
+	if(sa->sa_family != AF_INET){
+		return -1;
+	}
+	struct sockaddr_in *in = (struct sockaddr_in *)sa;
+	for(int i = 0; i < n; i++){
+		if(upstreams[i].addr.sin_addr.s_addr == in->sin_addr.s_addr && upstreams[i].addr.sin_port == in->sin_port){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ Picks the server to send a query to: the fastest one that is up and hasnt been tried yet for it (tried is a bitmask).
+ If they have all been tried, the fastest one that is up. If they are all down, the one that comes back soonest.
+ The servers we pass over get a little faster on paper, so a slow one is tried again now and then to see if it got better.
+
+ returns the index of the server.
+*/
+int upstream_pick(dns_upstream_t *upstreams, int n, uint32_t tried, uint64_t now){
+	int best = -1;
+	for(int pass = 0; pass < 2 && best < 0; pass++){
+		for(int i = 0; i < n; i++){
+			if(upstreams[i].down_until > now || (pass == 0 && (tried & (1u << i)))){
+				continue;
+			}
+			if(best < 0 || upstreams[i].srtt < upstreams[best].srtt){
+				best = i;
+			}
+		}
+	}
+	if(best < 0){
+		best = 0;
+		for(int i = 1; i < n; i++){
+			if(upstreams[i].down_until < upstreams[best].down_until){
+				best = i;
+			}
+		}
+		return best;
+	}
+
+	for(int i = 0; i < n; i++){
+		if(i != best){
+			// rounded up so it still moves when small, but not to 0, which means we havent heard back.
+			if(upstreams[i].srtt > 1){
+				upstreams[i].srtt -= (upstreams[i].srtt + 63) / 64;
+			}
+		}
+	}
+	return best;
+}
+
+/**
+ How long to wait for an answer from a server before trying again, in ms.
+*/
+int upstream_timeout(dns_upstream_t *upstream){
+	int timeout = upstream->srtt * 3 / SRTT_SCALE;
+	if(timeout < MIN_TIMEOUT){
+		return MIN_TIMEOUT;
+	}
+	if(timeout > MAX_TIMEOUT){
+		return MAX_TIMEOUT;
+	}
+	return timeout;
+}
+
+/**
+ Records an answer from a server. rtt is how long it took in ms,
+ or -1 if we cant tell because the query was sent more than once.
+*/
+void upstream_success(dns_upstream_t *upstream, int rtt){
+	upstream->failures = 0;
+	upstream->down_until = 0;
+	if(rtt < 0){
+		return;
+	}
+	if(upstream->srtt == 0){
+		upstream->srtt = rtt > 0 ? rtt * SRTT_SCALE : 1;
+	}else{
+		upstream->srtt += (rtt * SRTT_SCALE - upstream->srtt) / 8;
+		if(upstream->srtt < 1){
+			upstream->srtt = 1;
+		}
+	}
+}
+
+/**
+ Records a server not answering in time.
+ Its RTT is pushed up so the others are preferred, and after FAILURE_LIMIT in a row it is taken out for a while.
+*/
+void upstream_failure(dns_upstream_t *upstream, uint64_t now){
+	upstream->srtt = upstream->srtt < MIN_TIMEOUT * SRTT_SCALE ? MIN_TIMEOUT * SRTT_SCALE : upstream->srtt * 2;
+	if(upstream->srtt > MAX_TIMEOUT * SRTT_SCALE){
+		upstream->srtt = MAX_TIMEOUT * SRTT_SCALE;
+	}
+	upstream->failures++;
+	if(upstream->failures >= FAILURE_LIMIT){
+		upstream->down_until = now + DOWN_TIME;
+	}
+}
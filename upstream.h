@@ -0,0 +1,28 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+//Most upstream servers we can be given, tried servers are kept as a bitmask.
+#define MAX_UPSTREAMS 16
+//srtt is kept in 1/SRTT_SCALE ms, so smoothing and decay still move it when it is only a few ms.
+#define SRTT_SCALE 8
+
+// A server we forward queries to, and how well it has been answering them.
+typedef struct dns_upstream{
+	struct sockaddr_in addr;
+	int srtt; // smoothed round trip time in 1/SRTT_SCALE ms, 0 until we have heard back
+	int failures; // timeouts in a row
+	uint64_t down_until; // ms, until then it is only used if every server is down
+} dns_upstream_t;
+
+int upstream_parse(char *text, dns_upstream_t *upstream);
+int upstream_find(dns_upstream_t *upstreams, int n, struct sockaddr *sa);
+int upstream_pick(dns_upstream_t *upstreams, int n, uint32_t tried, uint64_t now);
+int upstream_timeout(dns_upstream_t *upstream);
+void upstream_success(dns_upstream_t *upstream, int rtt);
+void upstream_failure(dns_upstream_t *upstream, uint64_t now);
+
+#endif
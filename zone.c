@@ -0,0 +1,1107 @@
+#define _GNU_SOURCE // for qsort_r
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "zone.h"
+#include "storage.h"
+
+#define FOLD_CASE(c) ((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c))
+
+// What next_token found.
+enum TOKEN {
+		TOKEN_ERROR=-1, TOKEN_END=0, TOKEN_LINE=1, TOKEN_WORD=2
+};
+
+// A zone we were asked to serve, and the master file it is loaded from.
+typedef struct dns_zone_spec{
+	char origin[255];
+	int origin_length;
+	char *path;
+} dns_zone_spec_t;
+
+// Where a master file is up to as it is parsed.
+typedef struct zone_parser{
+	char *p;
+	char *end;
+	int line;
+	int parens; // open parentheses, line ends inside them dont end the entry.
+	char *token; // last word read, it isnt NUL terminated.
+	int token_length;
+	char origin[255]; // $ORIGIN, names that dont end with a '.' are under it.
+	int origin_length;
+	uint32_t ttl; // $TTL, or before there is one the last TTL a record gave.
+	bool has_ttl;
+	bool ttl_directive;
+} zone_parser_t;
+
+// A record as it is read from the master file, before they are sorted into names.
+typedef struct zone_entry{
+	uint64_t head;
+	uint32_t key;
+	uint32_t name;
+	uint8_t key_length;
+	dns_zone_record_t record;
+} zone_entry_t;
+
+// Record types master files can have in them, by name.
+typedef struct zone_type{
+	char *name;
+	uint16_t type;
+} zone_type_t;
+
+zone_type_t zone_types[] = {
+	{"A", T_A}, {"NS", T_NS}, {"CNAME", T_CNAME}, {"SOA", T_SOA}, {"PTR", T_PTR},
+	{"MX", T_MX}, {"TXT", T_TXT}, {"AAAA", T_AAAA}, {"SRV", T_SRV}
+};
+
+dns_zone_spec_t zone_specs[MAX_ZONES];
+int zone_spec_no = 0;
+
+// Zones being served, lookups read it without a lock. load_zones swaps in a new set and frees the old one
+// once every worker has passed a quiescent point, see cache_synchronize.
+dns_zone_set_t *zone_set = NULL;
+
+int next_token(zone_parser_t *);
+bool token_is(zone_parser_t *, char *);
+int token_char(zone_parser_t *, int *);
+int token_name(zone_parser_t *, char *);
+bool token_ttl(zone_parser_t *, uint32_t *);
+bool token_number(zone_parser_t *, uint32_t, uint32_t *);
+uint16_t token_type(zone_parser_t *);
+int parse_generic_rdata(zone_parser_t *, uint16_t, char *);
+bool skip_entry(zone_parser_t *);
+int parse_rdata(zone_parser_t *, uint16_t, char *);
+int zone_prefix(dns_zone_t *, char *);
+int zone_key(char *, int, char *);
+uint64_t key_head(char *, int);
+int key_compare(char *, int, char *, int);
+int compare_entries(const void *, const void *, void *);
+int64_t zone_data(dns_zone_t *, size_t *, void *, int);
+dns_zone_t *load_zone(dns_zone_spec_t *);
+void free_zone(dns_zone_t *);
+void free_zones(dns_zone_set_t *);
+dns_zone_t *find_zone(dns_zone_set_t *, char *, int *);
+int find_name(dns_zone_t *, uint64_t, char *, int);
+void zone_rr(dns_zone_t *, dns_zone_record_t *, dns_resource_record_t *);
+int encode_soa(dns_zone_t *, dns_encoder_t *);
+
+/**
+ Adds a zone to serve, given as origin:path (like example.com:/etc/zones/example.com), load_zones loads it.
+ returns -1 if it isnt in that form, or there are already MAX_ZONES.
+*/
+int zone_add(char *arg){
+	char *colon = strchr(arg, ':');
+	if(colon == NULL || colon == arg || colon[1] == '\0' || colon - arg > 254 || zone_spec_no == MAX_ZONES){
+		return -1;
+	}
+	dns_zone_spec_t *spec = &zone_specs[zone_spec_no];
+	char origin[256];
+	memcpy(origin, arg, colon - arg);
+	origin[colon - arg] = '\0';
+	if(strcmp(origin, ".") == 0){
+		spec->origin[0] = 0;
+		spec->origin_length = 1;
+	}else if((spec->origin_length = string_to_domainname(origin, spec->origin)) < 0){
+		return -1;
+	}
+	spec->path = colon + 1;
+	zone_spec_no++;
+	return 0;
+}
+
+/**
+ Reads the next word of the entry the parser is at into parser->token, a "quoted string" is one word without its quotes.
+ Comments are skipped, and so are line ends inside parentheses.
+ returns TOKEN_WORD, TOKEN_LINE at the end of an entry, TOKEN_END at the end of the file, or TOKEN_ERROR.
+*/
+int next_token(zone_parser_t *parser){
+	while(parser->p < parser->end){
+		char c = *parser->p;
+		if(c == ' ' || c == '\t' || c == '\r'){
+			parser->p++;
+		}else if(c == ';'){
+			while(parser->p < parser->end && *parser->p != '\n'){
+				parser->p++;
+			}
+		}else if(c == '\n'){
+			parser->p++;
+			parser->line++;
+			if(parser->parens == 0){
+				return TOKEN_LINE;
+			}
+		}else if(c == '('){
+			parser->parens++;
+			parser->p++;
+		}else if(c == ')'){
+			if(parser->parens == 0){
+				return TOKEN_ERROR;
+			}
+			parser->parens--;
+			parser->p++;
+		}else{
+			break;
+		}
+	}
+	if(parser->p == parser->end){
+		return parser->parens == 0 ? TOKEN_END : TOKEN_ERROR;
+	}
+
+	bool quoted = *parser->p == '"';
+	if(quoted){
+		parser->p++;
+	}
+	parser->token = parser->p;
+	while(parser->p < parser->end){
+		char c = *parser->p;
+		if(c == '\\' && parser->p + 1 < parser->end && parser->p[1] != '\n'){
+			parser->p += 2;
+			continue;
+		}
+		if(quoted ? c == '"' || c == '\n' : c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ';' || c == '(' || c == ')' || c == '"'){
+			break;
+		}
+		parser->p++;
+	}
+	parser->token_length = parser->p - parser->token;
+	if(quoted){
+		if(parser->p == parser->end || *parser->p != '"'){
+			return TOKEN_ERROR; // quoted strings dont go over lines.
+		}
+		parser->p++;
+	}
+	return TOKEN_WORD;
+}
+
+/**
+ Checks if the last word read is word, ignoring case.
+*/
+bool token_is(zone_parser_t *parser, char *word){
+	return parser->token_length == strlen(word) && strncasecmp(parser->token, word, parser->token_length) == 0;
+}
+
+/**
+ Reads the character of the last word at *i, which may be escaped as \X or \DDD, and moves *i past it.
+ returns the character, or -1 if the escape isnt valid.
+*/
+int token_char(zone_parser_t *parser, int *i){
+	char *token = parser->token;
+	if(token[*i] != '\\'){
+		return (unsigned char)token[(*i)++];
+	}
+	if(*i + 1 >= parser->token_length){
+		return -1;
+	}
+	if(!isdigit((unsigned char)token[*i + 1])){
+		*i += 2;
+		return (unsigned char)token[*i - 1];
+	}
+	if(*i + 3 >= parser->token_length || !isdigit((unsigned char)token[*i + 2]) || !isdigit((unsigned char)token[*i + 3])){
+		return -1;
+	}
+	int c = (token[*i + 1] - '0') * 100 + (token[*i + 2] - '0') * 10 + token[*i + 3] - '0';
+	*i += 4;
+	return c <= 255 ? c : -1;
+}
+
+/**
+ Converts the last word to a wire format name in out, which should point to at least 255 bytes.
+ Names that dont end with a '.' are under $ORIGIN, and "@" is $ORIGIN itself.
+ returns the length of the name, or -1 if it isnt valid.
+*/
+int token_name(zone_parser_t *parser, char *out){
+	if(token_is(parser, "@")){
+		memcpy(out, parser->origin, parser->origin_length);
+		return parser->origin_length;
+	}
+	if(token_is(parser, ".")){
+		out[0] = 0;
+		return 1;
+	}
+	int n = 1; // out[label] is where the length of the label being read goes.
+	int label = 0;
+	bool absolute = false;
+	int i = 0;
+	while(i < parser->token_length){
+		if(parser->token[i] == '.'){
+			if(n - label - 1 == 0){
+				return -1;
+			}
+			out[label] = n - label - 1;
+			label = n++;
+			absolute = true;
+			i++;
+			continue;
+		}
+		int c = token_char(parser, &i);
+		if(c < 0 || n - label - 1 == 63 || n >= 254){
+			return -1;
+		}
+		out[n++] = c;
+		absolute = false;
+	}
+	if(absolute){
+		out[label] = 0;
+		return n;
+	}
+	out[label] = n - label - 1;
+	if(n + parser->origin_length > 255){
+		return -1;
+	}
+	memcpy(out + n, parser->origin, parser->origin_length);
+	return n + parser->origin_length;
+}
+
+/**
+ Reads the last word as a TTL, in seconds or with units like 1h30m.
+ returns false if it isnt one.
+*/
+bool token_ttl(zone_parser_t *parser, uint32_t *ttl){
+	if(!isdigit((unsigned char)parser->token[0])){
+		return false;
+	}
+	uint64_t total = 0;
+	uint64_t value = 0;
+	bool digits = false;
+	for(int i = 0; i < parser->token_length; i++){
+		char c = parser->token[i];
+		if(isdigit((unsigned char)c)){
+			value = value * 10 + c - '0';
+			digits = true;
+			if(value > UINT32_MAX){
+				return false;
+			}
+			continue;
+		}
+		if(!digits){
+			return false;
+		}
+		switch(tolower((unsigned char)c)){
+			case 's': break;
+			case 'm': value *= 60; break;
+			case 'h': value *= 3600; break;
+			case 'd': value *= 86400; break;
+			case 'w': value *= 604800; break;
+			default: return false;
+		}
+		total += value;
+		value = 0;
+		digits = false;
+	}
+	total += value;
+	if(total > UINT32_MAX){
+		return false;
+	}
+	*ttl = total;
+	return true;
+}
+
+/**
+ Reads the last word as a number no bigger than max.
+ returns false if it isnt one.
+*/
+bool token_number(zone_parser_t *parser, uint32_t max, uint32_t *number){
+	uint64_t value = 0;
+	for(int i = 0; i < parser->token_length; i++){
+		if(!isdigit((unsigned char)parser->token[i])){
+			return false;
+		}
+		value = value * 10 + parser->token[i] - '0';
+		if(value > max){
+			return false;
+		}
+	}
+	*number = value;
+	return true;
+}
+
+/**
+ Reads the last word as a record type, by name or as TYPEnnn for any type (RFC 3597).
+ returns the type, or 0 if it isnt one we know.
+*/
+uint16_t token_type(zone_parser_t *parser){
+	for(int i = 0; i < sizeof(zone_types) / sizeof(zone_types[0]); i++){
+		if(token_is(parser, zone_types[i].name)){
+			return zone_types[i].type;
+		}
+	}
+	uint32_t type;
+	if(parser->token_length > 4 && strncasecmp(parser->token, "TYPE", 4) == 0){
+		parser->token += 4;
+		parser->token_length -= 4;
+		bool number = token_number(parser, UINT16_MAX, &type);
+		parser->token -= 4;
+		parser->token_length += 4;
+		if(number && type != T_OPT){
+			return type;
+		}
+	}
+	return 0;
+}
+
+/**
+ Parses RData in the generic form of RFC 3597, "\# length" and then the bytes in hex, split up however.
+ It can be given for any type, but RData with names in it still has to hold whole ones.
+ returns its length, or -1 if it isnt valid or the entry doesnt end after it.
+*/
+int parse_generic_rdata(zone_parser_t *parser, uint16_t type, char *rdata){
+	uint32_t length;
+	if(next_token(parser) != TOKEN_WORD || !token_number(parser, UINT16_MAX, &length)){
+		return -1;
+	}
+	int n = 0;
+	int token;
+	while((token = next_token(parser)) == TOKEN_WORD){
+		for(int i = 0; i < parser->token_length; i += 2){
+			if(i + 1 >= parser->token_length || n >= length
+					|| !isxdigit((unsigned char)parser->token[i]) || !isxdigit((unsigned char)parser->token[i + 1])){
+				return -1;
+			}
+			char hex[3] = {parser->token[i], parser->token[i + 1], '\0'};
+			rdata[n++] = strtol(hex, NULL, 16);
+		}
+	}
+	if((token != TOKEN_LINE && token != TOKEN_END) || n != length){
+		return -1;
+	}
+	if((type == T_A && n != 4) || (type == T_AAAA && n != 16) || !rdata_valid(type, rdata, n)){
+		return -1;
+	}
+	return n;
+}
+
+/**
+ Skips the rest of an entry.
+ returns false if the file is broken before it ends.
+*/
+bool skip_entry(zone_parser_t *parser){
+	int token;
+	while((token = next_token(parser)) == TOKEN_WORD){
+	}
+	return token != TOKEN_ERROR;
+}
+
+/**
+ Parses the RData of a record of the given type from the rest of the entry into rdata, which is 65535 bytes long.
+ Names in it are written uncompressed, as they are in the cache.
+ returns its length, or -1 if it isnt valid or the entry doesnt end after it.
+*/
+int parse_rdata(zone_parser_t *parser, uint16_t type, char *rdata){
+	int n = 0;
+	int length;
+	int token;
+	uint32_t number;
+	char text[64];
+
+	// a look at the first word, to see if it is in the generic form.
+	char *start = parser->p;
+	int line = parser->line;
+	int parens = parser->parens;
+	if(next_token(parser) == TOKEN_WORD && token_is(parser, "\\#")){
+		return parse_generic_rdata(parser, type, rdata);
+	}
+	parser->p = start;
+	parser->line = line;
+	parser->parens = parens;
+
+	switch(type){
+		case T_A:
+		case T_AAAA:
+			if(next_token(parser) != TOKEN_WORD || parser->token_length >= sizeof(text)){
+				return -1;
+			}
+			memcpy(text, parser->token, parser->token_length);
+			text[parser->token_length] = '\0';
+			if(inet_pton(type == T_A ? AF_INET : AF_INET6, text, rdata) != 1){
+				return -1;
+			}
+			n = type == T_A ? 4 : 16;
+			break;
+		case T_MX:
+		case T_SRV:
+			// preference, or priority, weight and port, before the name.
+			for(int i = 0; i < (type == T_MX ? 1 : 3); i++){
+				if(next_token(parser) != TOKEN_WORD || !token_number(parser, UINT16_MAX, &number)){
+					return -1;
+				}
+				rdata[n++] = number >> 8;
+				rdata[n++] = number & 0xFF;
+			}
+			// fall through
+		case T_NS:
+		case T_CNAME:
+		case T_PTR:
+			if(next_token(parser) != TOKEN_WORD || (length = token_name(parser, rdata + n)) < 0){
+				return -1;
+			}
+			n += length;
+			break;
+		case T_SOA:
+			for(int i = 0; i < 2; i++){
+				if(next_token(parser) != TOKEN_WORD || (length = token_name(parser, rdata + n)) < 0){
+					return -1;
+				}
+				n += length;
+			}
+			// serial, then refresh, retry, expire and minimum, which can have units like TTLs.
+			for(int i = 0; i < 5; i++){
+				if(next_token(parser) != TOKEN_WORD || !(i == 0 ? token_number(parser, UINT32_MAX, &number) : token_ttl(parser, &number))){
+					return -1;
+				}
+				number = htonl(number);
+				memcpy(rdata + n, &number, 4);
+				n += 4;
+			}
+			break;
+		case T_TXT:
+			while((token = next_token(parser)) == TOKEN_WORD){
+				if(n + 256 > 65535){
+					return -1;
+				}
+				int start = n++;
+				int i = 0;
+				while(i < parser->token_length){
+					int c = token_char(parser, &i);
+					if(c < 0 || n - start - 1 == 255){
+						return -1;
+					}
+					rdata[n++] = c;
+				}
+				rdata[start] = n - start - 1;
+			}
+			return n > 0 && (token == TOKEN_LINE || token == TOKEN_END) ? n : -1;
+		default:
+			return -1;
+	}
+	token = next_token(parser);
+	return token == TOKEN_LINE || token == TOKEN_END ? n : -1;
+}
+
+/**
+ Works out how much of a wire format name comes before the zone's origin.
+ returns the number of bytes before it, or -1 if the name isnt in the zone.
+*/
+int zone_prefix(dns_zone_t *zone, char *name){
+	int length = domainname_length(name);
+	int prefix = 0;
+	while(length - prefix > zone->origin_length){
+		prefix += (unsigned char)name[prefix] + 1;
+	}
+	if(length - prefix != zone->origin_length || !name_equal(name + prefix, zone->origin)){
+		return -1;
+	}
+	return prefix;
+}
+
+/**
+ Makes the key a name is sorted by in its zone: its labels below the origin, from the origin down and lowercased.
+ prefix is the number of bytes of the name before the origin (see zone_prefix), which is the length of the key too.
+ Keys of names under a name start with its key, so they sort right after it.
+*/
+int zone_key(char *name, int prefix, char *key){
+	int labels[128];
+	int label_no = 0;
+	for(int i = 0; i < prefix; i += (unsigned char)name[i] + 1){
+		labels[label_no++] = i;
+	}
+	int n = 0;
+	while(label_no > 0){
+		char *label = name + labels[--label_no];
+		int length = (unsigned char)*label;
+		key[n++] = length;
+		for(int i = 1; i <= length; i++){
+			unsigned char c = label[i];
+			key[n++] = FOLD_CASE(c);
+		}
+	}
+	return n;
+}
+
+/**
+ Returns the first 8 bytes of a key as a number, padded with 0s, which orders the same as the bytes would.
+*/
+uint64_t key_head(char *key, int length){
+	uint64_t head = 0;
+	for(int i = 0; i < 8; i++){
+		head = (head << 8) | (i < length ? (unsigned char)key[i] : 0);
+	}
+	return head;
+}
+
+/**
+ Orders two keys, a key comes before every longer key that starts with it.
+*/
+int key_compare(char *a, int a_length, char *b, int b_length){
+	int order = memcmp(a, b, a_length < b_length ? a_length : b_length);
+	if(order != 0){
+		return order;
+	}
+	return a_length - b_length;
+}
+
+/**
+ qsort_r comparison for zone_entry_t, by key and then by where they were in the file.
+*/
+int compare_entries(const void *a, const void *b, void *data){
+	const zone_entry_t *x = a;
+	const zone_entry_t *y = b;
+	if(x->head != y->head){
+		return x->head < y->head ? -1 : 1;
+	}
+	int order = key_compare((char *)data + x->key, x->key_length, (char *)data + y->key, y->key_length);
+	if(order != 0){
+		return order;
+	}
+	return x->record.rdata < y->record.rdata ? -1 : x->record.rdata > y->record.rdata;
+}
+
+/**
+ Appends length bytes to the zone's data, growing it to capacity as needed.
+ returns their offset, or -1 if the data cant grow or would be too big for an offset.
+*/
+int64_t zone_data(dns_zone_t *zone, size_t *capacity, void *bytes, int length){
+	if(zone->data == NULL || zone->data_length + length > *capacity){
+		size_t new_capacity = *capacity == 0 ? 65536 : *capacity * 2;
+		if(new_capacity > UINT32_MAX){
+			return -1;
+		}
+		char *data = realloc(zone->data, new_capacity);
+		if(data == NULL){
+			return -1;
+		}
+		zone->data = data;
+		*capacity = new_capacity;
+	}
+	memcpy(zone->data + zone->data_length, bytes, length);
+	zone->data_length += length;
+	return zone->data_length - length;
+}
+
+/**
+ Loads a zone from its master file. This is the RFC 1035 format, with $ORIGIN and $TTL but not $INCLUDE,
+ for the types in zone_types. Records outside the zone are left out.
+ The records are sorted by name into one block of names and one of records, with the keys, names and RData in a third.
+ returns the zone, or NULL if the file couldnt be read or has something in it we dont understand, which is printed.
+*/
+dns_zone_t *load_zone(dns_zone_spec_t *spec){
+	int fd = open(spec->path, O_RDONLY);
+	if(fd < 0){
+		printf("cant open zone file %s\n", spec->path);
+		return NULL;
+	}
+	struct stat st;
+	char *file = NULL;
+	if(fstat(fd, &st) < 0 || (st.st_size > 0 && (file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)){
+		printf("cant read zone file %s\n", spec->path);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	if(file != NULL){
+		madvise(file, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	zone_parser_t parser;
+	memset(&parser, 0, sizeof(parser));
+	parser.p = file;
+	parser.end = file + st.st_size;
+	parser.line = 1;
+	memcpy(parser.origin, spec->origin, spec->origin_length);
+	parser.origin_length = spec->origin_length;
+
+	dns_zone_t *zone = calloc(1, sizeof(dns_zone_t));
+	char *rdata = malloc(65535);
+	zone_entry_t *entries = NULL;
+	int entry_no = 0;
+	int entry_capacity = 0;
+	size_t data_capacity = 0;
+	char *error = NULL;
+	if(zone == NULL || rdata == NULL){
+		error = "out of memory";
+		goto fail;
+	}
+	memcpy(zone->origin, spec->origin, spec->origin_length);
+	zone->origin_length = spec->origin_length;
+	zone->path = spec->path;
+
+	// the owner of the last entry, and where it went in data so records with the same owner share it.
+	char owner[255];
+	int owner_length = 0;
+	bool owner_stored = false;
+	zone_entry_t owner_entry;
+	int ignored = 0;
+
+	while(1){
+		bool blank = parser.p < parser.end && (*parser.p == ' ' || *parser.p == '\t');
+		int token = next_token(&parser);
+		if(token == TOKEN_END){
+			break;
+		}
+		if(token == TOKEN_LINE){
+			continue;
+		}
+		if(token == TOKEN_ERROR){
+			error = "unbalanced parentheses or quotes";
+			goto fail;
+		}
+
+		if(!blank && parser.token[0] == '$'){
+			if(token_is(&parser, "$ORIGIN")){
+				char origin[255];
+				int length;
+				if(next_token(&parser) != TOKEN_WORD || (length = token_name(&parser, origin)) < 0){
+					error = "bad $ORIGIN";
+					goto fail;
+				}
+				memcpy(parser.origin, origin, length);
+				parser.origin_length = length;
+			}else if(token_is(&parser, "$TTL")){
+				if(next_token(&parser) != TOKEN_WORD || !token_ttl(&parser, &parser.ttl)){
+					error = "bad $TTL";
+					goto fail;
+				}
+				parser.has_ttl = true;
+				parser.ttl_directive = true;
+			}else{
+				error = "unsupported directive";
+				goto fail;
+			}
+			token = next_token(&parser);
+			if(token != TOKEN_LINE && token != TOKEN_END){
+				error = "junk after directive";
+				goto fail;
+			}
+			continue;
+		}
+
+		if(!blank){
+			if((owner_length = token_name(&parser, owner)) < 0){
+				error = "bad owner name";
+				goto fail;
+			}
+			owner_stored = false;
+			token = next_token(&parser);
+		}else if(owner_length == 0){
+			error = "no owner name";
+			goto fail;
+		}
+
+		// TTL and class can come in either order, and either can be left out.
+		uint32_t ttl = parser.ttl;
+		bool has_ttl = parser.has_ttl;
+		while(token == TOKEN_WORD){
+			if(token_ttl(&parser, &ttl)){
+				has_ttl = true;
+				if(!parser.ttl_directive){
+					parser.ttl = ttl;
+					parser.has_ttl = true;
+				}
+			}else if(token_is(&parser, "IN")){
+				// its the only class we serve.
+			}else{
+				break;
+			}
+			token = next_token(&parser);
+		}
+		if(token != TOKEN_WORD){
+			error = "missing type";
+			goto fail;
+		}
+		uint16_t type = token_type(&parser);
+		if(type == 0){
+			// a type we dont know the text form of shouldnt keep the rest of the zone from loading.
+			printf("%s:%d: skipping record of unknown type %.*s\n", spec->path, parser.line, parser.token_length, parser.token);
+			if(!skip_entry(&parser)){
+				error = "unbalanced parentheses or quotes";
+				goto fail;
+			}
+			continue;
+		}
+		if(!has_ttl){
+			error = "no TTL";
+			goto fail;
+		}
+		int rdlength = parse_rdata(&parser, type, rdata);
+		if(rdlength < 0){
+			error = "bad RData";
+			goto fail;
+		}
+
+		int prefix = zone_prefix(zone, owner);
+		if(prefix < 0){
+			ignored++;
+			continue;
+		}
+		if(type == T_SOA && prefix != 0){
+			error = "SOA isnt at the origin";
+			goto fail;
+		}
+		if(!owner_stored){
+			char key[255];
+			int key_length = zone_key(owner, prefix, key);
+			int64_t key_offset = zone_data(zone, &data_capacity, key, key_length);
+			int64_t name_offset = zone_data(zone, &data_capacity, owner, owner_length);
+			if(key_offset < 0 || name_offset < 0){
+				error = "zone too big";
+				goto fail;
+			}
+			owner_entry.head = key_head(key, key_length);
+			owner_entry.key = key_offset;
+			owner_entry.name = name_offset;
+			owner_entry.key_length = key_length;
+			owner_stored = true;
+		}
+		int64_t rdata_offset = zone_data(zone, &data_capacity, rdata, rdlength);
+		if(rdata_offset < 0){
+			error = "zone too big";
+			goto fail;
+		}
+
+		if(entry_no == entry_capacity){
+			int new_capacity = entry_capacity == 0 ? 1024 : entry_capacity * 2;
+			zone_entry_t *new_entries = realloc(entries, new_capacity * sizeof(zone_entry_t));
+			if(new_entries == NULL){
+				error = "out of memory";
+				goto fail;
+			}
+			entries = new_entries;
+			entry_capacity = new_capacity;
+		}
+		zone_entry_t *entry = &entries[entry_no++];
+		*entry = owner_entry;
+		entry->record.rdata = rdata_offset;
+		entry->record.ttl = ttl;
+		entry->record.type = type;
+		entry->record.class = C_IN;
+		entry->record.rdlength = rdlength;
+	}
+	if(file != NULL){
+		munmap(file, st.st_size);
+		file = NULL;
+	}
+	free(rdata);
+	rdata = NULL;
+	if(ignored > 0){
+		printf("%s: left out %d records outside the zone\n", spec->path, ignored);
+	}
+
+	// master files are mostly in order already, which doesnt need sorting.
+	for(int i = 1; i < entry_no; i++){
+		if(compare_entries(&entries[i-1], &entries[i], zone->data) > 0){
+			qsort_r(entries, entry_no, sizeof(zone_entry_t), compare_entries, zone->data);
+			break;
+		}
+	}
+
+	zone->records = malloc(entry_no * sizeof(dns_zone_record_t));
+	zone->names = malloc(entry_no * sizeof(dns_zone_name_t));
+	if(entry_no > 0 && (zone->records == NULL || zone->names == NULL)){
+		error = "out of memory";
+		goto fail;
+	}
+	bool has_soa = false;
+	for(int i = 0; i < entry_no; i++){
+		zone_entry_t *entry = &entries[i];
+		dns_zone_name_t *name = zone->name_no > 0 ? &zone->names[zone->name_no - 1] : NULL;
+		if(name == NULL || key_compare(zone->data + name->key, name->key_length, zone->data + entry->key, entry->key_length) != 0){
+			name = &zone->names[zone->name_no++];
+			name->head = entry->head;
+			name->key = entry->key;
+			name->name = entry->name;
+			name->key_length = entry->key_length;
+			name->records = i;
+			name->record_no = 0;
+		}
+		if(name->record_no == UINT16_MAX){
+			error = "too many records for one name";
+			goto fail;
+		}
+		name->record_no++;
+		zone->records[i] = entry->record;
+		if(entry->record.type == T_SOA){
+			if(has_soa){
+				error = "more than one SOA";
+				goto fail;
+			}
+			zone->soa = i;
+			has_soa = true;
+		}
+	}
+	zone->record_no = entry_no;
+	free(entries);
+	entries = NULL;
+	if(!has_soa){
+		error = "no SOA at the origin";
+		goto fail;
+	}
+	dns_zone_name_t *names = realloc(zone->names, zone->name_no * sizeof(dns_zone_name_t));
+	if(names != NULL){
+		zone->names = names;
+	}
+
+	// NS records anywhere but the origin make a cut, everything from there down is another zone's.
+	int cut = -1;
+	for(int i = 0; i < zone->name_no; i++){
+		dns_zone_name_t *name = &zone->names[i];
+		if(cut >= 0 && (zone->names[cut].key_length > name->key_length
+				|| memcmp(zone->data + zone->names[cut].key, zone->data + name->key, zone->names[cut].key_length) != 0)){
+			cut = -1;
+		}
+		for(int r = name->records; cut < 0 && name->key_length > 0 && r < name->records + name->record_no; r++){
+			if(zone->records[r].type == T_NS){
+				cut = i;
+			}
+		}
+		name->cut = cut;
+	}
+	return zone;
+
+fail:
+	printf("%s:%d: %s\n", spec->path, parser.line, error);
+	if(file != NULL){
+		munmap(file, st.st_size);
+	}
+	free(rdata);
+	free(entries);
+	if(zone != NULL){
+		free_zone(zone);
+	}
+	return NULL;
+}
+
+/**
+ Frees a zone and everything in it.
+*/
+void free_zone(dns_zone_t *zone){
+	free(zone->names);
+	free(zone->records);
+	free(zone->data);
+	free(zone);
+}
+
+/**
+ Frees a set of zones and every zone in it.
+*/
+void free_zones(dns_zone_set_t *set){
+	for(int i = 0; i < set->zone_no; i++){
+		free_zone(set->zones[i]);
+	}
+	free(set);
+}
+
+/**
+ Loads every zone added with zone_add, and once they have all loaded swaps them in for the ones being served.
+ Lookups go on using the old zones while this runs, they are freed once no worker can still be looking at them.
+ If a zone doesnt load nothing is swapped, so a mistake in one master file doesnt take the rest down with it.
+ returns the number of records loaded, or -1 if a zone didnt load.
+*/
+int load_zones(){
+	dns_zone_set_t *set = malloc(sizeof(dns_zone_set_t) + zone_spec_no * sizeof(dns_zone_t *));
+	if(set == NULL){
+		return -1;
+	}
+	set->zone_no = 0;
+	int record_no = 0;
+	for(int i = 0; i < zone_spec_no; i++){
+		dns_zone_t *zone = load_zone(&zone_specs[i]);
+		if(zone == NULL){
+			free_zones(set);
+			return -1;
+		}
+		set->zones[set->zone_no++] = zone;
+		record_no += zone->record_no;
+	}
+
+	dns_zone_set_t *old = __atomic_exchange_n(&zone_set, set, __ATOMIC_ACQ_REL);
+	if(old != NULL){
+		// workers dont hold on to anything from a zone past the batch they are on, as with the cache.
+		cache_synchronize();
+		free_zones(old);
+	}
+	return record_no;
+}
+
+/**
+ Finds the zone a wire format name is in, the one with the longest origin if they nest.
+ Sets prefix to the number of bytes of the name before the origin.
+ returns the zone, or NULL if it isnt in any.
+*/
+dns_zone_t *find_zone(dns_zone_set_t *set, char *name, int *prefix){
+	dns_zone_t *found = NULL;
+	for(int i = 0; i < set->zone_no; i++){
+		dns_zone_t *zone = set->zones[i];
+		if(found != NULL && zone->origin_length <= found->origin_length){
+			continue;
+		}
+		int length = zone_prefix(zone, name);
+		if(length >= 0){
+			found = zone;
+			*prefix = length;
+		}
+	}
+	return found;
+}
+
+/**
+ Binary searches the zone's names for a key.
+ returns the index of the first name whose key doesnt come before it, which is name_no if they all do.
+*/
+int find_name(dns_zone_t *zone, uint64_t head, char *key, int key_length){
+	int low = 0;
+	int high = zone->name_no;
+	while(low < high){
+		int middle = low + (high - low) / 2;
+		dns_zone_name_t *name = &zone->names[middle];
+		int order = name->head != head ? (name->head < head ? -1 : 1)
+			: key_compare(zone->data + name->key, name->key_length, key, key_length);
+		if(order < 0){
+			low = middle + 1;
+		}else{
+			high = middle;
+		}
+	}
+	return low;
+}
+
+/**
+ Fills in rr from a record of the zone, its RData points into the zone.
+*/
+void zone_rr(dns_zone_t *zone, dns_zone_record_t *record, dns_resource_record_t *rr){
+	rr->Type = record->type;
+	rr->Class = record->class;
+	rr->TTL = record->ttl;
+	rr->RDLength = record->rdlength;
+	rr->RData = zone->data + record->rdata;
+}
+
+/**
+ Adds the zone's SOA to the authority section, for an answer saying a name or type doesnt exist.
+ Its TTL is lowered to the SOA's minimum, which is how long that can be cached for.
+ returns -1 if it doesnt fit.
+*/
+int encode_soa(dns_zone_t *zone, dns_encoder_t *encoder){
+	dns_zone_record_t *soa = &zone->records[zone->soa];
+	dns_resource_record_t rr;
+	zone_rr(zone, soa, &rr);
+	uint32_t minimum;
+	memcpy(&minimum, zone->data + soa->rdata + soa->rdlength - 4, 4);
+	minimum = ntohl(minimum);
+	if(minimum < rr.TTL){
+		rr.TTL = minimum;
+	}
+	return encode_record(encoder, AUTHORITY, zone->origin, &rr);
+}
+
+/**
+ Answers a question from the zone its name is in, with AA set. CNAMEs are followed while they stay in the zone,
+ a name without records of the type gets NODATA and one that doesnt exist NXDOMAIN, with the SOA either way.
+ Names at or under a zone cut are left alone, and so are names in none of our zones.
+ Wildcards arent supported.
+
+ returns the number of records encoded, 0 if its not ours to answer, or -1 if the answer doesnt fit.
+*/
+int zone_answer(dns_question_t *question, dns_encoder_t *encoder){
+	dns_zone_set_t *set = __atomic_load_n(&zone_set, __ATOMIC_ACQUIRE);
+	if(set == NULL || (question->QClass != C_IN && question->QClass != QC_ALL)){
+		return 0;
+	}
+	int prefix;
+	dns_zone_t *zone = find_zone(set, question->QName, &prefix);
+	if(zone == NULL){
+		return 0;
+	}
+	encoder->buf[2] |= 0x04; // AA, if we dont answer after all the message is started again.
+
+	char *name = question->QName;
+	int count = 0;
+	int rcode = 0;
+	for(int chain = 0; chain < MAX_CHAIN; chain++){
+		char key[255];
+		int key_length = zone_key(name, prefix, key);
+		uint64_t head = key_head(key, key_length);
+		int i = find_name(zone, head, key, key_length);
+		bool found = i < zone->name_no && zone->names[i].key_length == key_length
+			&& memcmp(zone->data + zone->names[i].key, key, key_length) == 0;
+
+		// whatever comes right before a name in order is under the same cut, if the name is under one.
+		dns_zone_name_t *before = found ? &zone->names[i] : i > 0 ? &zone->names[i-1] : NULL;
+		if(before != NULL && before->cut >= 0){
+			dns_zone_name_t *cut = &zone->names[before->cut];
+			if(cut->key_length <= key_length && memcmp(zone->data + cut->key, key, cut->key_length) == 0){
+				if(count == 0){
+					return 0;
+				}
+				break; // a CNAME led there, the client follows it from here.
+			}
+		}
+
+		if(!found){
+			// a name with names under it exists, even without records of its own.
+			dns_zone_name_t *after = i < zone->name_no ? &zone->names[i] : NULL;
+			if(after == NULL || after->key_length <= key_length || memcmp(zone->data + after->key, key, key_length) != 0){
+				rcode = 3; // NXDOMAIN
+			}
+			if(encode_soa(zone, encoder) < 0){
+				return -1;
+			}
+			count++;
+			break;
+		}
+
+		dns_zone_name_t *entry = &zone->names[i];
+		dns_zone_record_t *cname = NULL;
+		int matched = 0;
+		for(int r = entry->records; r < entry->records + entry->record_no; r++){
+			dns_zone_record_t *record = &zone->records[r];
+			if(record->type == question->QType || question->QType == QT_ALL){
+				dns_resource_record_t rr;
+				zone_rr(zone, record, &rr);
+				if(encode_record(encoder, ANSWER, name, &rr) < 0){
+					return -1;
+				}
+				matched++;
+			}else if(record->type == T_CNAME){
+				cname = record;
+			}
+		}
+		count += matched;
+		if(matched > 0){
+			break;
+		}
+		if(cname == NULL){
+			if(encode_soa(zone, encoder) < 0){
+				return -1;
+			}
+			count++;
+			break;
+		}
+
+		dns_resource_record_t rr;
+		zone_rr(zone, cname, &rr);
+		if(encode_record(encoder, ANSWER, name, &rr) < 0){
+			return -1;
+		}
+		count++;
+		name = rr.RData;
+		if((prefix = zone_prefix(zone, name)) < 0){
+			break; // it leads out of the zone, the client follows it from here.
+		}
+	}
+	encoder->buf[3] = (encoder->buf[3] & 0xF0) | rcode;
+	return count;
+}
+
+/**
+ Checks if a wire format name is in one of our zones, so a copy of an answer from the cache isnt used for it.
+*/
+bool zone_covers(char *name){
+	dns_zone_set_t *set = __atomic_load_n(&zone_set, __ATOMIC_ACQUIRE);
+	int prefix;
+	return set != NULL && find_zone(set, name, &prefix) != NULL;
+}
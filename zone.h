@@ -0,0 +1,59 @@
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "dns.h"
+
+//Most zones we can serve with -z.
+#define MAX_ZONES 64
+
+// A record of a zone, its RData is in the zone's data.
+typedef struct dns_zone_record{
+	uint32_t rdata; // offset in data
+	uint32_t ttl;
+	uint16_t type;
+	uint16_t class;
+	uint16_t rdlength;
+} dns_zone_record_t;
+
+// A name in a zone that has records, they are the record_no records from records.
+typedef struct dns_zone_name{
+	uint64_t head; // first 8 bytes of its key as a number, most comparisons in a search dont need more.
+	uint32_t key; // offset in data of its key, see zone_key.
+	uint32_t name; // offset in data of its wire format name.
+	uint32_t records;
+	uint16_t record_no;
+	uint8_t key_length;
+	int32_t cut; // name of the zone cut it is at or under, -1 if it isnt delegated. Names under a cut arent ours to answer for.
+} dns_zone_name_t;
+
+// A zone loaded from a master file. It is never changed once loaded, a reload builds a new one.
+// Names are sorted by key, their labels from the root down, so a binary search finds one
+// and every name under it comes right after it.
+typedef struct dns_zone{
+	char origin[255]; // wire format
+	int origin_length;
+	char *path; // master file it was loaded from.
+	uint32_t soa; // index of the SOA record, for negative answers.
+	int name_no;
+	dns_zone_name_t *names;
+	int record_no;
+	dns_zone_record_t *records;
+	size_t data_length;
+	char *data; // keys, names and RData.
+} dns_zone_t;
+
+// Every zone we serve, swapped out as a whole when they are reloaded.
+typedef struct dns_zone_set{
+	int zone_no;
+	dns_zone_t *zones[];
+} dns_zone_set_t;
+
+int zone_add(char *arg);
+int load_zones();
+int zone_answer(dns_question_t *question, dns_encoder_t *encoder);
+bool zone_covers(char *name);
+
+#endif